@@ -0,0 +1,47 @@
+#!/bin/sh
+# Run the same plugin from two blockreplay builds over a trace and diff
+# everything it writes. Use it to check that an optimization didn't change
+# a plugin's output.
+#
+# Usage: compare.sh <build dir A> <build dir B> <plugin> <trace.gz> [blockreplay options...]
+#
+# Relative paths in plugin arguments are resolved inside a scratch
+# directory per build, so give input files (-m, -p, pcfile=...) as
+# absolute paths.
+
+if [ $# -lt 4 ]; then
+    echo "usage: $0 <build A> <build B> <plugin> <trace.gz> [blockreplay options...]" >&2
+    exit 2
+fi
+
+A=$(cd "$1" && pwd)
+B=$(cd "$2" && pwd)
+PLUGIN=$3
+TRACE=$(cd "$(dirname "$4")" && pwd)/$(basename "$4")
+shift 4
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+for side in A B; do
+    eval dir=\$$side
+    mkdir "$WORK/$side"
+    echo "== $side: $dir"
+    (cd "$WORK/$side" && "$dir/blockreplay" "$@" "$dir/panda_$PLUGIN.so" "$TRACE" > "$WORK/$side.stdout") || exit 1
+done
+
+# Compressed outputs differ in their headers even when the data matches,
+# so compare them decompressed
+for f in $(cd "$WORK/A" && find . -name '*.gz'); do
+    for side in A B; do
+        [ -f "$WORK/$side/$f" ] && gunzip "$WORK/$side/$f"
+    done
+done
+
+if diff -r "$WORK/A" "$WORK/B" > "$WORK/diff" && diff "$WORK/A.stdout" "$WORK/B.stdout" >> "$WORK/diff"; then
+    echo "outputs match"
+else
+    head -50 "$WORK/diff"
+    echo "outputs differ"
+    exit 1
+fi
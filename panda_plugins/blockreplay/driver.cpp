@@ -0,0 +1,514 @@
+// blockreplay: feed a blocktrace capture through a plugin's block callbacks
+// at full speed, without QEMU. Plugins are built against the headers in
+// stub/ and dlopen()ed; the PANDA and OSI functions they call are
+// implemented here.
+//
+// Usage: blockreplay [-a key=value]... [-m modules.txt] [-p procs.txt]
+//                    [-n max_events] panda_plugin.so trace.gz
+
+#define __STDC_FORMAT_MACROS
+
+extern "C" {
+
+#include "config.h"
+#include "panda_plugin.h"
+#include "rr_log.h"
+#include "osi/osi_types.h"
+#include "osi/osi_ext.h"
+
+}
+
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <zlib.h>
+
+#include "blocktrace_fmt.h"
+
+// Everything here is static: the driver is linked with -rdynamic, so any
+// global it exports would take the place of a plugin global with the same
+// name. Only the PANDA/OSI API and rr_end_replay_requested are exported.
+
+// Plugin arguments, from -a
+static std::map<std::string,std::string> plugin_args;
+
+static std::vector<panda_cb> callbacks[PANDA_CB_LAST];
+
+// State of the event being replayed
+static uint64_t cur_instr_count = 0;
+static target_ulong cur_asid = 0;
+volatile int rr_end_replay_requested = 0;
+
+// A TB as the driver sees it; gen is the flush_gen it was last translated in
+struct replay_tb {
+    TranslationBlock tb;
+    uint32_t gen;
+};
+static uint32_t flush_gen = 0;
+
+// Guest memory as far as we know it: the code bytes from translate
+// events. Looked up by (asid, page) first, then by page alone, since
+// kernel code is shared by every address space.
+#define PAGE_BITS 12
+#define PAGE_SIZE (1 << PAGE_BITS)
+
+struct page {
+    uint8_t data[PAGE_SIZE];
+    uint8_t valid[PAGE_SIZE / 8];
+};
+
+struct pair_hash {
+    size_t operator()(const std::pair<uint64_t,uint64_t> &p) const {
+        return p.first * 0x9E3779B97F4A7C15ULL ^ p.second;
+    }
+};
+
+static std::unordered_map<std::pair<uint64_t,uint64_t>,page *,pair_hash> asid_pages;
+static std::unordered_map<uint64_t,page *> any_pages;
+
+// OSI shim data, from -m and -p
+static std::vector<OsiModule> modules;
+static std::vector<OsiProc> procs;
+
+static void store_code(uint64_t asid, uint64_t addr, const uint8_t *buf, size_t len) {
+    for (size_t i = 0; i < len; i++, addr++) {
+        uint64_t pg = addr >> PAGE_BITS;
+        page *&p = asid_pages[std::make_pair(asid, pg)];
+        if (!p) p = (page *)calloc(1, sizeof(page));
+        any_pages[pg] = p;
+        size_t off = addr & (PAGE_SIZE - 1);
+        p->data[off] = buf[i];
+        p->valid[off / 8] |= 1 << (off % 8);
+    }
+}
+
+extern "C" {
+
+void panda_register_callback(void *plugin, panda_cb_type type, panda_cb cb) {
+    callbacks[type].push_back(cb);
+}
+
+panda_arg_list *panda_get_args(const char *plugin_name) {
+    panda_arg_list *args = (panda_arg_list *)calloc(1, sizeof(panda_arg_list));
+    args->list = (panda_arg *)calloc(plugin_args.size() + 1, sizeof(panda_arg));
+    for (auto &kvp : plugin_args) {
+        panda_arg &a = args->list[args->nargs++];
+        a.key = strdup(kvp.first.c_str());
+        a.value = strdup(kvp.second.c_str());
+    }
+    return args;
+}
+
+void panda_free_args(panda_arg_list *args) {
+    // Plugins keep pointers to argument strings, so these are never freed
+}
+
+static const char *find_arg(panda_arg_list *args, const char *argname) {
+    if (!args) return NULL;
+    for (int i = 0; i < args->nargs; i++) {
+        if (!strcmp(args->list[i].key, argname)) return args->list[i].value;
+    }
+    return NULL;
+}
+
+target_ulong panda_parse_ulong(panda_arg_list *args, const char *argname, target_ulong defval) {
+    const char *v = find_arg(args, argname);
+    return v ? strtoull(v, NULL, 0) : defval;
+}
+
+uint32_t panda_parse_uint32(panda_arg_list *args, const char *argname, uint32_t defval) {
+    const char *v = find_arg(args, argname);
+    return v ? strtoul(v, NULL, 0) : defval;
+}
+
+uint64_t panda_parse_uint64(panda_arg_list *args, const char *argname, uint64_t defval) {
+    const char *v = find_arg(args, argname);
+    return v ? strtoull(v, NULL, 0) : defval;
+}
+
+double panda_parse_double(panda_arg_list *args, const char *argname, double defval) {
+    const char *v = find_arg(args, argname);
+    return v ? strtod(v, NULL) : defval;
+}
+
+bool panda_parse_bool(panda_arg_list *args, const char *argname) {
+    const char *v = find_arg(args, argname);
+    return v && (!strcmp(v, "true") || !strcmp(v, "1") || !strcmp(v, "yes"));
+}
+
+const char *panda_parse_string(panda_arg_list *args, const char *argname, const char *defval) {
+    const char *v = find_arg(args, argname);
+    return v ? v : defval;
+}
+
+void panda_require(const char *plugin_name) {}
+// Memory callbacks never fire, but track whether they would have, so
+// plugins that toggle them can be checked
+static bool memcb_enabled = false;
+
+void panda_enable_memcb(void) {
+    memcb_enabled = true;
+}
+
+void panda_disable_memcb(void) {
+    memcb_enabled = false;
+}
+// Like QEMU, a flush makes every TB get translated again (so
+// after_block_translate runs again) the next time it executes
+void panda_do_flush_tb(void) {
+    flush_gen++;
+}
+
+int panda_virtual_memory_rw(CPUState *env, target_ulong addr, uint8_t *buf, int len, int is_write) {
+    if (is_write) return -1;
+    for (int i = 0; i < len; i++) {
+        uint64_t a = (uint64_t)addr + i;
+        uint64_t pg = a >> PAGE_BITS;
+        auto it = asid_pages.find(std::make_pair((uint64_t)cur_asid, pg));
+        page *p = NULL;
+        if (it != asid_pages.end()) {
+            p = it->second;
+        }
+        else {
+            auto ait = any_pages.find(pg);
+            if (ait != any_pages.end()) p = ait->second;
+        }
+        size_t off = a & (PAGE_SIZE - 1);
+        if (!p || !(p->valid[off / 8] & (1 << (off % 8)))) return -1;
+        buf[i] = p->data[off];
+    }
+    return 0;
+}
+
+target_ulong panda_current_asid(CPUState *env) {
+    return cur_asid;
+}
+
+uint64_t rr_get_guest_instr_count(void) {
+    return cur_instr_count;
+}
+
+OsiModules *get_modules(CPUState *env) {
+    OsiModules *ms = (OsiModules *)malloc(sizeof(OsiModules));
+    ms->num = modules.size();
+    ms->module = (OsiModule *)malloc(modules.size() * sizeof(OsiModule));
+    for (size_t i = 0; i < modules.size(); i++) {
+        ms->module[i] = modules[i];
+        ms->module[i].name = strdup(modules[i].name);
+        ms->module[i].file = strdup(modules[i].file);
+    }
+    return ms;
+}
+
+void free_osimodules(OsiModules *ms) {
+    if (!ms) return;
+    for (uint32_t i = 0; i < ms->num; i++) {
+        free(ms->module[i].name);
+        free(ms->module[i].file);
+    }
+    free(ms->module);
+    free(ms);
+}
+
+static OsiProc copy_proc(const OsiProc &p) {
+    OsiProc c = p;
+    c.name = strdup(p.name);
+    c.pages = NULL;
+    return c;
+}
+
+OsiProc *get_current_process(CPUState *env) {
+    for (auto &p : procs) {
+        if (p.asid == cur_asid) {
+            OsiProc *c = (OsiProc *)malloc(sizeof(OsiProc));
+            *c = copy_proc(p);
+            return c;
+        }
+    }
+    return NULL;
+}
+
+OsiProcs *get_processes(CPUState *env) {
+    OsiProcs *ps = (OsiProcs *)malloc(sizeof(OsiProcs));
+    ps->num = procs.size();
+    ps->proc = (OsiProc *)malloc(procs.size() * sizeof(OsiProc));
+    for (size_t i = 0; i < procs.size(); i++)
+        ps->proc[i] = copy_proc(procs[i]);
+    return ps;
+}
+
+void free_osiproc(OsiProc *p) {
+    if (!p) return;
+    free(p->name);
+    free(p);
+}
+
+void free_osiprocs(OsiProcs *ps) {
+    if (!ps) return;
+    for (uint32_t i = 0; i < ps->num; i++)
+        free(ps->proc[i].name);
+    free(ps->proc);
+    free(ps);
+}
+
+}
+
+// Plugins may register more callbacks from inside a callback (e.g. when
+// start_instr is reached). Like PANDA, don't run those until the next event.
+template <typename F>
+static inline void run_callbacks(panda_cb_type type, F call) {
+    size_t n = callbacks[type].size();
+    for (size_t i = 0; i < n; i++) call(callbacks[type][i]);
+}
+
+// The trace has no explicit address space switches; deliver a pgd change
+// whenever consecutive events are in different address spaces
+static void switch_asid(CPUState *env, target_ulong asid) {
+    if (asid == cur_asid) return;
+    target_ulong old = cur_asid;
+    cur_asid = asid;
+    run_callbacks(PANDA_CB_VMI_PGD_CHANGED, [&](panda_cb &cb) {
+        cb.vmi_pgd_changed(env, old, asid);
+    });
+}
+
+// Modules file: one "<base> <size> <name> <file>" per line, base and size in hex
+static bool load_modules(const char *fname) {
+    std::ifstream f(fname);
+    if (!f) return false;
+    std::string name, file;
+    uint64_t base, size;
+    while (f >> std::hex >> base >> size >> name >> file) {
+        OsiModule m = {};
+        m.base = base;
+        m.size = size;
+        m.name = strdup(name.c_str());
+        m.file = strdup(file.c_str());
+        modules.push_back(m);
+    }
+    return true;
+}
+
+// Processes file: one "<asid> <pid> <ppid> <name>" per line, asid in hex
+static bool load_procs(const char *fname) {
+    std::ifstream f(fname);
+    if (!f) return false;
+    std::string name;
+    uint64_t asid, pid, ppid;
+    while (f >> std::hex >> asid >> std::dec >> pid >> ppid >> name) {
+        OsiProc p = {};
+        p.asid = asid;
+        p.pid = pid;
+        p.ppid = ppid;
+        p.name = strdup(name.c_str());
+        procs.push_back(p);
+    }
+    return true;
+}
+
+static bool load_trace(const char *fname, std::vector<uint8_t> &trace) {
+    gzFile f = gzopen(fname, "rb");
+    if (!f) return false;
+    uint8_t buf[1 << 16];
+    int n;
+    while ((n = gzread(f, buf, sizeof(buf))) > 0)
+        trace.insert(trace.end(), buf, buf + n);
+    gzclose(f);
+    return n == 0;
+}
+
+static long peak_rss_kb() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-a key=value]... [-m modules.txt] [-p procs.txt] "
+            "[-n max_events] panda_plugin.so trace.gz\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    uint64_t max_events = UINT64_MAX;
+    int opt;
+    while ((opt = getopt(argc, argv, "a:m:p:n:")) != -1) {
+        switch (opt) {
+            case 'a': {
+                const char *eq = strchr(optarg, '=');
+                if (!eq) usage(argv[0]);
+                plugin_args[std::string(optarg, eq - optarg)] = eq + 1;
+                break;
+            }
+            case 'm':
+                if (!load_modules(optarg)) {
+                    fprintf(stderr, "Couldn't read modules file %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'p':
+                if (!load_procs(optarg)) {
+                    fprintf(stderr, "Couldn't read processes file %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'n':
+                max_events = strtoull(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2) usage(argv[0]);
+    const char *plugin_path = argv[optind];
+    const char *trace_path = argv[optind + 1];
+
+    // Decompress the whole trace up front so we only time the plugin
+    std::vector<uint8_t> trace;
+    if (!load_trace(trace_path, trace) || trace.size() < sizeof(bt_header)) {
+        fprintf(stderr, "Couldn't read trace %s\n", trace_path);
+        return 1;
+    }
+    bt_header *hdr = (bt_header *)trace.data();
+#if defined(TARGET_X86_64)
+    const uint32_t arch = BT_ARCH_X86_64;
+#elif defined(TARGET_I386)
+    const uint32_t arch = BT_ARCH_I386;
+#elif defined(TARGET_ARM)
+    const uint32_t arch = BT_ARCH_ARM;
+#endif
+    if (memcmp(hdr->magic, BLOCKTRACE_MAGIC, sizeof(hdr->magic)) || hdr->version != BLOCKTRACE_VERSION) {
+        fprintf(stderr, "%s is not a blocktrace file\n", trace_path);
+        return 1;
+    }
+    if (hdr->arch != arch) {
+        fprintf(stderr, "%s was recorded for a different guest arch (%u, this build is %u)\n",
+                trace_path, hdr->arch, arch);
+        return 1;
+    }
+
+    void *plugin = dlopen(plugin_path, RTLD_NOW);
+    if (!plugin) {
+        fprintf(stderr, "dlopen: %s\n", dlerror());
+        return 1;
+    }
+    bool (*init_plugin)(void *) = (bool (*)(void *))dlsym(plugin, "init_plugin");
+    void (*uninit_plugin)(void *) = (void (*)(void *))dlsym(plugin, "uninit_plugin");
+    if (!init_plugin || !uninit_plugin) {
+        fprintf(stderr, "%s doesn't look like a PANDA plugin\n", plugin_path);
+        return 1;
+    }
+    if (!init_plugin(plugin)) {
+        fprintf(stderr, "init_plugin failed\n");
+        return 1;
+    }
+
+    long base_rss = peak_rss_kb();
+
+    CPUState env = {};
+    std::unordered_map<uint64_t,replay_tb *> tbs;
+    uint64_t nevents = 0, ntranslate = 0, nexec = 0, nretranslate = 0, nexec_memcb = 0;
+    bool used_memcb = false;
+
+    auto start = std::chrono::steady_clock::now();
+    size_t off = sizeof(bt_header);
+    while (off < trace.size() && nevents < max_events && !rr_end_replay_requested) {
+        if (trace[off] == BT_TRANSLATE) {
+            bt_translate ev;
+            if (trace.size() - off < sizeof(ev)) {
+                fprintf(stderr, "Truncated trace at offset %zu\n", off);
+                return 1;
+            }
+            memcpy(&ev, &trace[off], sizeof(ev));
+            off += sizeof(ev);
+            if (ev.has_code) {
+                if (trace.size() - off < ev.size) {
+                    fprintf(stderr, "Truncated trace at offset %zu\n", off);
+                    return 1;
+                }
+                store_code(ev.asid, ev.pc, &trace[off], ev.size);
+                off += ev.size;
+            }
+
+            replay_tb *&rtb = tbs[ev.tb];
+            if (!rtb) rtb = (replay_tb *)calloc(1, sizeof(replay_tb));
+            TranslationBlock *tb = &rtb->tb;
+            tb->pc = ev.pc;
+            tb->size = ev.size;
+            rtb->gen = flush_gen;
+#if defined(TARGET_I386)
+            env.hflags = ev.cpu_flags;
+#elif defined(TARGET_ARM)
+            env.thumb = ev.cpu_flags;
+#endif
+            switch_asid(&env, ev.asid);
+            run_callbacks(PANDA_CB_AFTER_BLOCK_TRANSLATE, [&](panda_cb &cb) {
+                cb.after_block_translate(&env, tb);
+            });
+            ntranslate++;
+        }
+        else if (trace[off] == BT_EXEC) {
+            bt_exec ev;
+            if (trace.size() - off < sizeof(ev)) {
+                fprintf(stderr, "Truncated trace at offset %zu\n", off);
+                return 1;
+            }
+            memcpy(&ev, &trace[off], sizeof(ev));
+            off += sizeof(ev);
+
+            auto it = tbs.find(ev.tb);
+            if (it != tbs.end()) {
+#if defined(TARGET_I386)
+                env.hflags = ev.cpu_flags;
+#elif defined(TARGET_ARM)
+                env.thumb = ev.cpu_flags;
+#endif
+                switch_asid(&env, ev.asid);
+                cur_instr_count = ev.instr_count;
+                TranslationBlock *tb = &it->second->tb;
+                if (it->second->gen != flush_gen) {
+                    it->second->gen = flush_gen;
+                    run_callbacks(PANDA_CB_AFTER_BLOCK_TRANSLATE, [&](panda_cb &cb) {
+                        cb.after_block_translate(&env, tb);
+                    });
+                    nretranslate++;
+                }
+                run_callbacks(PANDA_CB_BEFORE_BLOCK_EXEC, [&](panda_cb &cb) {
+                    cb.before_block_exec(&env, tb);
+                });
+            }
+            nexec++;
+            if (memcb_enabled) nexec_memcb++;
+            used_memcb |= memcb_enabled;
+        }
+        else {
+            fprintf(stderr, "Corrupt trace at offset %zu\n", off);
+            return 1;
+        }
+        nevents++;
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    uninit_plugin(plugin);
+
+    double secs = std::chrono::duration<double>(end - start).count();
+    fprintf(stderr, "blockreplay: %" PRIu64 " events (%" PRIu64 " translations, %" PRIu64 " execs, "
+            "%" PRIu64 " retranslated after a flush) in %.3f s, %.0f events/sec%s\n",
+            nevents, ntranslate, nexec, nretranslate, secs,
+            secs > 0 ? nevents / secs : 0.0, rr_end_replay_requested ? " (plugin ended replay)" : "");
+    fprintf(stderr, "blockreplay: peak RSS %ld KB (%ld KB after init_plugin)\n",
+            peak_rss_kb(), base_rss);
+    if (used_memcb) {
+        fprintf(stderr, "blockreplay: memory callbacks were enabled for %" PRIu64 " of %" PRIu64 " block executions\n",
+                nexec_memcb, nexec);
+    }
+    return 0;
+}
@@ -0,0 +1,50 @@
+// Minimal stand-in for QEMU's config.h/cpu.h, just enough for the plugins
+// in this repo to build against blockreplay instead of a real PANDA tree.
+// Pick the guest with -DTARGET_I386, -DTARGET_I386 -DTARGET_X86_64, or
+// -DTARGET_ARM.
+
+#ifndef __BLOCKREPLAY_CONFIG_H
+#define __BLOCKREPLAY_CONFIG_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+#if defined(TARGET_X86_64)
+#define TARGET_LONG_SIZE 8
+typedef uint64_t target_ulong;
+#define TARGET_FMT_lx "%016" PRIx64
+#else
+#define TARGET_LONG_SIZE 4
+typedef uint32_t target_ulong;
+#define TARGET_FMT_lx "%08x"
+#endif
+
+#if defined(TARGET_I386)
+#define HF_CS32_MASK (1 << 4)
+#define HF_LMA_MASK  (1 << 14)
+#define HF_CS64_MASK (1 << 15)
+#endif
+
+typedef struct CPUState {
+#if defined(TARGET_I386)
+    uint32_t hflags;
+#elif defined(TARGET_ARM)
+    int thumb;
+#endif
+} CPUState;
+
+typedef struct TranslationBlock {
+    target_ulong pc;
+    target_ulong cs_base;
+    uint64_t flags;
+    uint16_t size;
+    uint16_t cflags;
+    uint32_t icount;
+} TranslationBlock;
+
+#endif
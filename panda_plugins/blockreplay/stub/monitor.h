@@ -0,0 +1 @@
+// Nothing needed from monitor.h offline
@@ -0,0 +1,16 @@
+#ifndef __BLOCKREPLAY_OSI_EXT_H
+#define __BLOCKREPLAY_OSI_EXT_H
+
+// OSI shim: blockreplay answers these from the files given with -m
+// (kernel modules) and -p (processes) rather than from guest memory.
+
+OsiProc *get_current_process(CPUState *env);
+OsiProcs *get_processes(CPUState *env);
+OsiModules *get_modules(CPUState *env);
+void free_osiproc(OsiProc *p);
+void free_osiprocs(OsiProcs *ps);
+void free_osimodules(OsiModules *ms);
+
+static inline bool init_osi_api(void) { return true; }
+
+#endif
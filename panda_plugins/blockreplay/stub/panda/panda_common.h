@@ -0,0 +1 @@
+// Nothing needed from panda_common.h offline
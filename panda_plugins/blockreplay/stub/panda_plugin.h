@@ -0,0 +1,59 @@
+#ifndef __BLOCKREPLAY_PANDA_PLUGIN_H
+#define __BLOCKREPLAY_PANDA_PLUGIN_H
+
+// The subset of the PANDA plugin API that blockreplay implements. Only
+// block and pgd callbacks are ever delivered; memory callbacks can be
+// registered but never fire.
+
+typedef enum panda_cb_type {
+    PANDA_CB_BEFORE_BLOCK_TRANSLATE,
+    PANDA_CB_AFTER_BLOCK_TRANSLATE,
+    PANDA_CB_BEFORE_BLOCK_EXEC,
+    PANDA_CB_AFTER_BLOCK_EXEC,
+    PANDA_CB_VIRT_MEM_READ,
+    PANDA_CB_VIRT_MEM_WRITE,
+    PANDA_CB_VMI_PGD_CHANGED,
+    PANDA_CB_LAST,
+} panda_cb_type;
+
+typedef union panda_cb {
+    int (*before_block_translate)(CPUState *env, target_ulong pc);
+    int (*after_block_translate)(CPUState *env, TranslationBlock *tb);
+    int (*before_block_exec)(CPUState *env, TranslationBlock *tb);
+    int (*after_block_exec)(CPUState *env, TranslationBlock *tb, TranslationBlock *next_tb);
+    int (*virt_mem_read)(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
+    int (*virt_mem_write)(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
+    int (*vmi_pgd_changed)(CPUState *env, target_ulong oldval, target_ulong newval);
+} panda_cb;
+
+void panda_register_callback(void *plugin, panda_cb_type type, panda_cb cb);
+
+typedef struct panda_arg {
+    char *argptr;
+    char *key;
+    char *value;
+} panda_arg;
+
+typedef struct panda_arg_list {
+    int nargs;
+    panda_arg *list;
+} panda_arg_list;
+
+panda_arg_list *panda_get_args(const char *plugin_name);
+void panda_free_args(panda_arg_list *args);
+target_ulong panda_parse_ulong(panda_arg_list *args, const char *argname, target_ulong defval);
+uint32_t panda_parse_uint32(panda_arg_list *args, const char *argname, uint32_t defval);
+uint64_t panda_parse_uint64(panda_arg_list *args, const char *argname, uint64_t defval);
+double panda_parse_double(panda_arg_list *args, const char *argname, double defval);
+bool panda_parse_bool(panda_arg_list *args, const char *argname);
+const char *panda_parse_string(panda_arg_list *args, const char *argname, const char *defval);
+
+void panda_require(const char *plugin_name);
+void panda_enable_memcb(void);
+void panda_disable_memcb(void);
+void panda_do_flush_tb(void);
+
+int panda_virtual_memory_rw(CPUState *env, target_ulong addr, uint8_t *buf, int len, int is_write);
+target_ulong panda_current_asid(CPUState *env);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef __BLOCKREPLAY_RR_LOG_H
+#define __BLOCKREPLAY_RR_LOG_H
+
+// Guest instruction count of the event being replayed
+uint64_t rr_get_guest_instr_count(void);
+
+// Set by plugins to stop the replay early
+extern volatile int rr_end_replay_requested;
+
+#endif
@@ -0,0 +1,151 @@
+/* PANDABEGINCOMMENT
+ * 
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ * 
+ * This work is licensed under the terms of the GNU GPL, version 2. 
+ * See the COPYING file in the top-level directory. 
+ * 
+PANDAENDCOMMENT */
+// This needs to be defined before anything is included in order to get
+// the PRIx64 macro
+#define __STDC_FORMAT_MACROS
+
+extern "C" {
+
+#include "config.h"
+#include "qemu-common.h"
+
+#include "panda_plugin.h"
+#include "rr_log.h"
+
+}
+
+// These need to be extern "C" so that the ABI is compatible with
+// QEMU/PANDA, which is written in C
+extern "C" {
+
+bool init_plugin(void *);
+void uninit_plugin(void *);
+
+}
+
+#include <unordered_map>
+
+#include <zlib.h>
+
+#include "blocktrace_fmt.h"
+
+gzFile trace;
+uint64_t ntranslate = 0;
+uint64_t nexec = 0;
+
+// (asid, pc) => hash of the code last recorded there, so unchanged code
+// is only written out once
+struct pair_hash {
+    size_t operator()(const std::pair<uint64_t,uint64_t> &p) const {
+        return p.first * 0x9E3779B97F4A7C15ULL ^ p.second;
+    }
+};
+std::unordered_map<std::pair<uint64_t,uint64_t>,uint64_t,pair_hash> seen_code;
+
+static inline uint32_t cpu_flags(CPUState *env) {
+#if defined(TARGET_I386)
+    return env->hflags;
+#elif defined(TARGET_ARM)
+    return env->thumb;
+#endif
+}
+
+static uint64_t hash_bytes(const uint8_t *buf, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= buf[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int after_block_translate(CPUState *env, TranslationBlock *tb) {
+    uint8_t code[0x10000];
+    bt_translate ev = {};
+    ev.type = BT_TRANSLATE;
+    ev.size = tb->size;
+    ev.cpu_flags = cpu_flags(env);
+    ev.tb = (uintptr_t)tb;
+    ev.pc = tb->pc;
+    ev.asid = panda_current_asid(env);
+
+    if (panda_virtual_memory_rw(env, tb->pc, code, tb->size, false) != -1) {
+        std::pair<uint64_t,uint64_t> key((uint64_t)ev.asid, (uint64_t)ev.pc);
+        uint64_t h = hash_bytes(code, tb->size);
+        auto it = seen_code.find(key);
+        if (it == seen_code.end() || it->second != h) {
+            seen_code[key] = h;
+            ev.has_code = 1;
+        }
+    }
+
+    gzwrite(trace, &ev, sizeof(ev));
+    if (ev.has_code) gzwrite(trace, code, tb->size);
+    ntranslate++;
+    return 0;
+}
+
+static int before_block_exec(CPUState *env, TranslationBlock *tb) {
+    bt_exec ev = {};
+    ev.type = BT_EXEC;
+    ev.cpu_flags = cpu_flags(env);
+    ev.tb = (uintptr_t)tb;
+    ev.asid = panda_current_asid(env);
+    ev.instr_count = rr_get_guest_instr_count();
+    gzwrite(trace, &ev, sizeof(ev));
+    nexec++;
+    return 0;
+}
+
+bool init_plugin(void *self) {
+    panda_cb pcb;
+
+    panda_arg_list *args = panda_get_args("blocktrace");
+    const char *name = panda_parse_string(args, "name", "blocktrace");
+
+    char fname[260];
+    snprintf(fname, sizeof(fname), "%s_blocktrace.gz", name);
+    trace = gzopen(fname, "wb1");
+    if (!trace) {
+        printf("Couldn't open %s for writing. Exiting.\n", fname);
+        return false;
+    }
+    gzbuffer(trace, 1 << 20);
+
+    bt_header hdr;
+    memcpy(hdr.magic, BLOCKTRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = BLOCKTRACE_VERSION;
+#if defined(TARGET_X86_64)
+    hdr.arch = BT_ARCH_X86_64;
+#elif defined(TARGET_I386)
+    hdr.arch = BT_ARCH_I386;
+#elif defined(TARGET_ARM)
+    hdr.arch = BT_ARCH_ARM;
+#endif
+    gzwrite(trace, &hdr, sizeof(hdr));
+    printf("blocktrace: will log to %s\n", fname);
+
+    pcb.after_block_translate = after_block_translate;
+    panda_register_callback(self, PANDA_CB_AFTER_BLOCK_TRANSLATE, pcb);
+    pcb.before_block_exec = before_block_exec;
+    panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
+
+    return true;
+}
+
+void uninit_plugin(void *self) {
+    gzclose(trace);
+    printf("blocktrace: recorded %" PRIu64 " translations and %" PRIu64 " block executions.\n",
+            ntranslate, nexec);
+}
@@ -0,0 +1,58 @@
+#ifndef __BLOCKTRACE_FMT_H
+#define __BLOCKTRACE_FMT_H
+
+// Block-event trace written by the blocktrace plugin and fed back through
+// other plugins by blockreplay. The file is gzip-compressed; uncompressed
+// it is a bt_header followed by a stream of events, each starting with a
+// one-byte type. All fields are little-endian.
+//
+//   BT_TRANSLATE: a bt_translate, then `size` bytes of code if has_code
+//                 is set. has_code is only set the first time a given
+//                 (asid, pc) is seen with those bytes.
+//   BT_EXEC:      a bt_exec
+//
+// TBs are identified by the address of the TranslationBlock in the
+// recording QEMU, so a recycled TB shows up as a new BT_TRANSLATE with an
+// id that was used before, exactly as the plugins saw it.
+
+#include <stdint.h>
+
+#define BLOCKTRACE_MAGIC "BTRC"
+#define BLOCKTRACE_VERSION 1
+
+enum {
+    BT_ARCH_I386 = 1,
+    BT_ARCH_X86_64 = 2,
+    BT_ARCH_ARM = 3,
+};
+
+#define BT_TRANSLATE 'T'
+#define BT_EXEC 'E'
+
+struct bt_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t arch;
+} __attribute__((packed));
+
+struct bt_translate {
+    uint8_t type;
+    uint8_t has_code;
+    uint16_t size;
+    // x86: env->hflags; ARM: env->thumb
+    uint32_t cpu_flags;
+    uint64_t tb;
+    uint64_t pc;
+    uint64_t asid;
+} __attribute__((packed));
+
+struct bt_exec {
+    uint8_t type;
+    uint8_t pad[3];
+    uint32_t cpu_flags;
+    uint64_t tb;
+    uint64_t asid;
+    uint64_t instr_count;
+} __attribute__((packed));
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef __HLL_H
+#define __HLL_H
+
+// HyperLogLog sketches, for estimating how many distinct values were seen
+// without keeping the values. Sketches come out of one arena that is
+// allocated up front, so the memory they use has a hard cap however many
+// keys end up wanting one.
+//
+//   hll_arena_init(&a, bytes)  reserve the arena; false if it can't be
+//   hll_alloc(&a, n)           n zeroed sketches, or NULL once it's full
+//   hll_add(s, v)              add a 64-bit value to a sketch
+//   hll_estimate(s)            estimated number of distinct values added
+//
+// A sketch has 2^HLL_BITS one-byte registers (256 bytes), which gives a
+// standard error of about 6.5%. Sketches can't be freed one at a time.
+//
+// hll_distinct wraps an arena for the common case of estimating, for each
+// of many keys, the distinct addresses and distinct PCs it was seen at
+// (manyss_crit and manyss_bigmem distinct_mb=). A key holds a NULL
+// hll_sketch pointer until its first hit, when it gets a pair of sketches;
+// once the arena is used up, later keys stay NULL.
+//
+//   hll_distinct_init(&d, mb)          mb MB arena, or off if mb is 0
+//   hll_distinct_add(&d, s, addr, pc)  record a hit for the key owning s
+//   hll_distinct_format(&d, s, buf)    " <addrs> <pcs>" for a report line,
+//                                      " - -" if the key never got
+//                                      sketches, "" if d is off
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdio.h>
+
+#define HLL_BITS 8
+#define HLL_REGS (1 << HLL_BITS)
+
+struct hll_sketch {
+    uint8_t reg[HLL_REGS];
+};
+
+struct hll_arena {
+    hll_sketch *base;
+    size_t size;
+    size_t used;
+};
+
+static bool hll_arena_init(hll_arena *a, size_t bytes) {
+    a->size = bytes / sizeof(hll_sketch);
+    a->used = 0;
+    // calloc of a large block is mmapped, so untouched pages cost nothing
+    a->base = (hll_sketch *)calloc(a->size ? a->size : 1, sizeof(hll_sketch));
+    return a->base != NULL;
+}
+
+static inline hll_sketch *hll_alloc(hll_arena *a, size_t n) {
+    if (a->size - a->used < n) return NULL;
+    hll_sketch *s = a->base + a->used;
+    a->used += n;
+    return s;
+}
+
+static inline void hll_add(hll_sketch *s, uint64_t v) {
+    // splitmix64 finalizer; addresses and PCs are far from uniform
+    v += 0x9e3779b97f4a7c15ULL;
+    v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    v = (v ^ (v >> 27)) * 0x94d049bb133111ebULL;
+    v ^= v >> 31;
+    unsigned idx = v >> (64 - HLL_BITS);
+    // Position of the first 1 bit in the rest; the low bit caps the rank
+    uint64_t rest = (v << HLL_BITS) | (1ULL << (HLL_BITS - 1));
+    uint8_t rank = __builtin_clzll(rest) + 1;
+    if (rank > s->reg[idx]) s->reg[idx] = rank;
+}
+
+static double hll_estimate(const hll_sketch *s) {
+    double sum = 0;
+    unsigned zeros = 0;
+    for (int i = 0; i < HLL_REGS; i++) {
+        sum += ldexp(1.0, -s->reg[i]);
+        if (!s->reg[i]) zeros++;
+    }
+    const double m = HLL_REGS;
+    double est = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    // Small counts: linear counting is more accurate
+    if (est <= 2.5 * m && zeros) est = m * log(m / zeros);
+    return est;
+}
+
+struct hll_distinct {
+    bool on;
+    hll_arena arena;
+};
+
+static bool hll_distinct_init(hll_distinct *d, uint64_t mb) {
+    d->on = mb != 0;
+    if (!d->on) return true;
+    return hll_arena_init(&d->arena, mb << 20);
+}
+
+// Number of keys that can get sketches
+static inline size_t hll_distinct_capacity(const hll_distinct *d) {
+    return d->arena.size / 2;
+}
+
+static inline size_t hll_distinct_bytes(const hll_distinct *d) {
+    return d->arena.used * sizeof(hll_sketch);
+}
+
+static inline void hll_distinct_add(hll_distinct *d, hll_sketch *&s,
+                                    uint64_t addr, uint64_t pc) {
+    if (!d->on) return;
+    // [0] addresses, [1] PCs
+    if (!s && !(s = hll_alloc(&d->arena, 2))) return;
+    hll_add(&s[0], addr);
+    hll_add(&s[1], pc);
+}
+
+// Returns false if the key should have had sketches but the arena ran out
+static bool hll_distinct_format(const hll_distinct *d, const hll_sketch *s,
+                                char *buf, size_t len) {
+    buf[0] = '\0';
+    if (!d->on) return true;
+    if (!s) {
+        snprintf(buf, len, " - -");
+        return false;
+    }
+    snprintf(buf, len, " %.0f %.0f", hll_estimate(&s[0]), hll_estimate(&s[1]));
+    return true;
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef __INSTR_RANGE_H
+#define __INSTR_RANGE_H
+
+// Common start_instr=/end_instr= arguments, so a plugin only does its real
+// work over a range of guest instructions.
+//
+// instr_range_init() takes two functions from the plugin. on_start should
+// do whatever is expensive (register the real callbacks, enable memory
+// callbacks); on_end undoes what it can. Until start_instr is reached the
+// only thing that runs is a before_block_exec callback that compares the
+// instruction count. When end_instr is reached on_end is called, and with
+// end_replay=true the replay is ended as well.
+//
+// PANDA can't unregister a callback, so handlers that on_start registers
+// should return early when instr_range_active() is false.
+//
+// Without start_instr, on_start is called straight from instr_range_init,
+// and without end_instr as well nothing else is registered.
+//
+// Handlers switch on and off at block boundaries, and memory callbacks
+// only take effect once code is retranslated, so the block at each end of
+// the range may be seen by both or neither of two adjacent ranges.
+//
+// Include this after panda_plugin.h and rr_log.h.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+typedef void (*instr_range_fn)(void *self);
+
+static const char *range_plugin;
+static void *range_self;
+static instr_range_fn range_on_start;
+static instr_range_fn range_on_end;
+static uint64_t range_start = 0;
+static uint64_t range_end = 0;
+static bool range_end_replay = false;
+static bool range_active = false;
+static bool range_done = false;
+
+static inline bool instr_range_active(void) {
+    return range_active;
+}
+
+static void range_begin(void) {
+    printf("%s: starting at instruction %" PRIu64 "\n", range_plugin, rr_get_guest_instr_count());
+    range_active = true;
+    range_on_start(range_self);
+}
+
+static void range_finish(void) {
+    printf("%s: stopping at instruction %" PRIu64 "\n", range_plugin, rr_get_guest_instr_count());
+    range_active = false;
+    range_done = true;
+    if (range_on_end) range_on_end(range_self);
+    if (range_end_replay) rr_end_replay_requested = 1;
+}
+
+static int range_before_block_exec(CPUState *env, TranslationBlock *tb) {
+    if (range_done) return 0;
+    uint64_t icount = rr_get_guest_instr_count();
+    if (!range_active) {
+        if (icount >= range_start) range_begin();
+    }
+    else if (range_end && icount >= range_end) {
+        range_finish();
+    }
+    return 0;
+}
+
+// Returns false if the range arguments don't make sense
+static bool instr_range_init(void *self, const char *plugin, panda_arg_list *args,
+                             instr_range_fn on_start, instr_range_fn on_end) {
+    range_plugin = plugin;
+    range_self = self;
+    range_on_start = on_start;
+    range_on_end = on_end;
+    range_start = panda_parse_uint64(args, "start_instr", 0);
+    range_end = panda_parse_uint64(args, "end_instr", 0);
+    range_end_replay = panda_parse_bool(args, "end_replay");
+
+    if (range_end && range_end <= range_start) {
+        printf("%s: end_instr must be after start_instr\n", plugin);
+        return false;
+    }
+    if (!range_start) {
+        range_active = true;
+        on_start(self);
+        if (!range_end) return true;
+    }
+
+    printf("%s: active from instruction %" PRIu64 " to ", plugin, range_start);
+    if (range_end) printf("%" PRIu64 "\n", range_end);
+    else printf("the end of the replay\n");
+
+    panda_cb pcb;
+    pcb.before_block_exec = range_before_block_exec;
+    panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
+    return true;
+}
+
+#endif
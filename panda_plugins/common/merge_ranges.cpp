@@ -0,0 +1,156 @@
+// Merge the outputs of several replays of the same recording over
+// different instruction ranges (start_instr=/end_instr=) into one.
+//
+// Usage: merge_ranges <mode> <output> <input>...
+//
+//   sum    "<key> <count>" lines: counts for the same key are added up and
+//          the result is sorted by count, highest first. manyss_crit and
+//          manyss_bigmem reports, insthist hotblocks= profiles.
+//   or     gzipped bitmaps of equal size, ORed together. kcov output.
+//   first  keep the first line for each key (first field), taking inputs
+//          in the order given. kmodcheck logs.
+//
+// Time-series outputs (insthist samples, the kmodcheck manifest) just need
+// concatenating in range order.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <zlib.h>
+
+static bool merge_sum(const char *out, char **in, int nin) {
+    std::unordered_map<std::string,uint64_t> counts;
+    for (int i = 0; i < nin; i++) {
+        std::ifstream f(in[i]);
+        if (!f) {
+            fprintf(stderr, "Couldn't open %s\n", in[i]);
+            return false;
+        }
+        std::string line;
+        while (std::getline(f, line)) {
+            size_t sp = line.rfind(' ');
+            if (sp == std::string::npos) continue;
+            counts[line.substr(0, sp)] += strtoull(line.c_str() + sp + 1, NULL, 10);
+        }
+    }
+
+    std::vector<std::pair<std::string,uint64_t>> sorted(counts.begin(), counts.end());
+    std::sort(sorted.begin(), sorted.end(),
+              [](const std::pair<std::string,uint64_t> &a, const std::pair<std::string,uint64_t> &b) {
+                  return a.second != b.second ? a.second > b.second : a.first < b.first;
+              });
+
+    FILE *f = fopen(out, "w");
+    if (!f) {
+        perror("fopen");
+        return false;
+    }
+    for (auto &kvp : sorted)
+        fprintf(f, "%s %" PRIu64 "\n", kvp.first.c_str(), kvp.second);
+    fclose(f);
+    printf("merge_ranges: %zu keys\n", sorted.size());
+    return true;
+}
+
+static bool merge_or(const char *out, char **in, int nin) {
+    std::vector<gzFile> files;
+    for (int i = 0; i < nin; i++) {
+        gzFile f = gzopen(in[i], "rb");
+        if (!f) {
+            fprintf(stderr, "Couldn't open %s\n", in[i]);
+            return false;
+        }
+        files.push_back(f);
+    }
+    gzFile o = gzopen(out, "wb");
+    if (!o) {
+        fprintf(stderr, "Couldn't open %s for writing\n", out);
+        return false;
+    }
+
+    // Stream through in chunks; kcov bitmaps are 256MB uncompressed
+    const size_t chunk = 1 << 20;
+    std::vector<uint8_t> acc(chunk), buf(chunk);
+    uint64_t total = 0, bits = 0;
+    while (true) {
+        int n = gzread(files[0], acc.data(), chunk);
+        if (n < 0) {
+            fprintf(stderr, "Error reading %s\n", in[0]);
+            return false;
+        }
+        for (size_t i = 1; i < files.size(); i++) {
+            if (gzread(files[i], buf.data(), n) != n) {
+                fprintf(stderr, "%s is not the same size as %s\n", in[i], in[0]);
+                return false;
+            }
+            for (int j = 0; j < n; j++) acc[j] |= buf[j];
+        }
+        if (n == 0) break;
+        for (int j = 0; j < n; j++) bits += __builtin_popcount(acc[j]);
+        gzwrite(o, acc.data(), n);
+        total += n;
+    }
+    for (size_t i = 1; i < files.size(); i++) {
+        if (!gzeof(files[i]) && gzread(files[i], buf.data(), 1) != 0) {
+            fprintf(stderr, "%s is not the same size as %s\n", in[i], in[0]);
+            return false;
+        }
+    }
+    for (gzFile f : files) gzclose(f);
+    gzclose(o);
+    printf("merge_ranges: %" PRIu64 " bytes, %" PRIu64 " bits set\n", total, bits);
+    return true;
+}
+
+static bool merge_first(const char *out, char **in, int nin) {
+    FILE *o = fopen(out, "w");
+    if (!o) {
+        perror("fopen");
+        return false;
+    }
+    std::unordered_set<std::string> seen;
+    for (int i = 0; i < nin; i++) {
+        std::ifstream f(in[i]);
+        if (!f) {
+            fprintf(stderr, "Couldn't open %s\n", in[i]);
+            return false;
+        }
+        std::string line;
+        while (std::getline(f, line)) {
+            if (seen.insert(line.substr(0, line.find(' '))).second)
+                fprintf(o, "%s\n", line.c_str());
+        }
+    }
+    fclose(o);
+    printf("merge_ranges: %zu keys\n", seen.size());
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s sum|or|first <output> <input>...\n", argv[0]);
+        return 1;
+    }
+    const char *mode = argv[1];
+    bool ok;
+    if (!strcmp(mode, "sum"))
+        ok = merge_sum(argv[2], argv + 3, argc - 3);
+    else if (!strcmp(mode, "or"))
+        ok = merge_or(argv[2], argv + 3, argc - 3);
+    else if (!strcmp(mode, "first"))
+        ok = merge_first(argv[2], argv + 3, argc - 3);
+    else {
+        fprintf(stderr, "Unknown mode %s\n", mode);
+        return 1;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,180 @@
+#ifndef __PLUGIN_STATS_H
+#define __PLUGIN_STATS_H
+
+// Opt-in cost accounting for plugins. Build with `make PLUGIN_STATS=1`
+// (which adds -DPLUGIN_STATS) to get, for each instrumented callback, a
+// call count and a log2 histogram of its latency in TSC cycles, plus named
+// byte counters for the plugin's large data structures. Without it every
+// macro below expands to nothing and the plugin is unchanged.
+//
+//   STATS_INIT(self, "name", args)   in init_plugin, after panda_get_args.
+//                                    Reads stats_interval=<N>: also dump a
+//                                    summary every N guest instructions.
+//   STATS_CALLBACK(before_block_exec) first statement of a callback; times
+//                                    the rest of the enclosing scope
+//   STATS_BYTES_ADD("trie", n)       a structure grew (or shrank) by n bytes
+//   STATS_BYTES_FN("maps", fn)       size_t fn(void) gives the current size
+//                                    of something, evaluated at dump time
+//   STATS_DUMP()                     in uninit_plugin
+//
+// Summaries are printed to stdout. Include this after panda_plugin.h and
+// rr_log.h.
+
+#ifdef PLUGIN_STATS
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+enum stats_cb_id {
+    STATS_CB_before_block_exec,
+    STATS_CB_after_block_translate,
+    STATS_CB_virt_mem_read,
+    STATS_CB_virt_mem_write,
+    STATS_CB_vmi_pgd_changed,
+    STATS_NUM_CB,
+};
+
+static const char *stats_cb_names[STATS_NUM_CB] = {
+    "before_block_exec",
+    "after_block_translate",
+    "virt_mem_read",
+    "virt_mem_write",
+    "vmi_pgd_changed",
+};
+
+struct stats_hist {
+    uint64_t calls;
+    uint64_t cycles;
+    // buckets[i] counts calls that took [2^i, 2^(i+1)) cycles
+    uint64_t buckets[64];
+};
+
+#define STATS_MAX_COUNTERS 16
+
+struct stats_counter {
+    const char *name;
+    int64_t bytes;
+    int64_t peak;
+    size_t (*fn)(void);
+};
+
+static const char *stats_plugin = "";
+static stats_hist stats_cb[STATS_NUM_CB];
+static stats_counter stats_counters[STATS_MAX_COUNTERS];
+static int stats_ncounters = 0;
+static uint64_t stats_interval = 0;
+static uint64_t stats_next_dump = 0;
+
+static inline uint64_t stats_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+struct stats_timer {
+    stats_hist *h;
+    uint64_t start;
+    stats_timer(stats_hist *h) : h(h), start(stats_now()) {}
+    ~stats_timer() {
+        uint64_t d = stats_now() - start;
+        h->calls++;
+        h->cycles += d;
+        h->buckets[d ? 63 - __builtin_clzll(d) : 0]++;
+    }
+};
+
+static stats_counter *stats_counter_get(const char *name) {
+    for (int i = 0; i < stats_ncounters; i++) {
+        if (!strcmp(stats_counters[i].name, name)) return &stats_counters[i];
+    }
+    if (stats_ncounters == STATS_MAX_COUNTERS) {
+        // Out of slots; lump the rest into the last one
+        return &stats_counters[STATS_MAX_COUNTERS - 1];
+    }
+    stats_counter *c = &stats_counters[stats_ncounters++];
+    c->name = name;
+    return c;
+}
+
+static inline void stats_bytes_add(stats_counter *c, int64_t n) {
+    c->bytes += n;
+    if (c->bytes > c->peak) c->peak = c->bytes;
+}
+
+static void stats_dump(void) {
+    printf("%s: stats at instruction %" PRIu64 "\n", stats_plugin, rr_get_guest_instr_count());
+    for (int i = 0; i < STATS_NUM_CB; i++) {
+        stats_hist *h = &stats_cb[i];
+        if (!h->calls) continue;
+        printf("%s:   %-22s %12" PRIu64 " calls %14" PRIu64 " cycles %8.1f avg\n",
+               stats_plugin, stats_cb_names[i], h->calls, h->cycles,
+               (double)h->cycles / h->calls);
+        for (int b = 0; b < 64; b++) {
+            if (!h->buckets[b]) continue;
+            char range[32];
+            snprintf(range, sizeof(range), "[2^%d, 2^%d)", b, b + 1);
+            printf("%s:     %-14s %12" PRIu64 " %5.1f%%\n", stats_plugin,
+                   range, h->buckets[b], 100.0 * h->buckets[b] / h->calls);
+        }
+    }
+    for (int i = 0; i < stats_ncounters; i++) {
+        stats_counter *c = &stats_counters[i];
+        if (c->fn) {
+            stats_bytes_add(c, (int64_t)c->fn() - c->bytes);
+        }
+        printf("%s:   %-22s %14" PRId64 " bytes %14" PRId64 " peak\n",
+               stats_plugin, c->name, c->bytes, c->peak);
+    }
+    fflush(stdout);
+}
+
+static int stats_before_block_exec(CPUState *env, TranslationBlock *tb) {
+    uint64_t icount = rr_get_guest_instr_count();
+    if (icount >= stats_next_dump) {
+        stats_dump();
+        stats_next_dump = icount + stats_interval;
+    }
+    return 0;
+}
+
+static void stats_init(void *self, const char *plugin, panda_arg_list *args) {
+    stats_plugin = plugin;
+    stats_interval = panda_parse_uint64(args, "stats_interval", 0);
+    if (stats_interval) {
+        stats_next_dump = stats_interval;
+        panda_cb pcb;
+        pcb.before_block_exec = stats_before_block_exec;
+        panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
+    }
+}
+
+#define STATS_INIT(self, plugin, args) stats_init(self, plugin, args)
+#define STATS_CALLBACK(cb) stats_timer __stats_timer(&stats_cb[STATS_CB_##cb])
+#define STATS_BYTES_ADD(name, n) do { \
+        static stats_counter *__c = stats_counter_get(name); \
+        stats_bytes_add(__c, (n)); \
+    } while (0)
+#define STATS_BYTES_FN(name, f) (stats_counter_get(name)->fn = (f))
+#define STATS_DUMP() stats_dump()
+
+#else
+
+#define STATS_INIT(self, plugin, args) do {} while (0)
+#define STATS_CALLBACK(cb) do {} while (0)
+#define STATS_BYTES_ADD(name, n) do {} while (0)
+#define STATS_BYTES_FN(name, f) do {} while (0)
+#define STATS_DUMP() do {} while (0)
+
+#endif
+
+#endif
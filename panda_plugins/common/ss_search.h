@@ -0,0 +1,191 @@
+#ifndef __SS_SEARCH_H
+#define __SS_SEARCH_H
+
+// Memory side of the string search plugins (manyss_crit, manyss_bigmem):
+// the per-address-space search windows, the asid=/proc= target filter and
+// switching memory callbacks on and off. The plugin only supplies the
+// matcher.
+//
+//   ss_search_init(self, plugin, args, match)  in init_plugin, once the
+//                     strings are loaded. Reads asid=, proc= and the
+//                     instr_range.h arguments; false if they don't work.
+//
+// match(env, pc, addr, search) is called after every byte-window update
+// with the last WINDOW_SIZE bytes seen, oldest first, NUL-terminated. Bytes
+// are case-folded and NULs and punctuation are skipped, so UTF-16 and
+// lightly formatted strings match too. pc and addr are those of the access
+// that completed the window.
+//
+// Each address space keeps its own read and write windows, so bytes from
+// different processes never run together into false matches. With asid= or
+// proc=, memory callbacks are only enabled while the target is running;
+// proc= is checked through OSI at the first block after each address
+// space switch.
+//
+// Include this after panda_plugin.h, rr_log.h, the OSI headers,
+// plugin_stats.h and instr_range.h.
+
+#include <stdio.h>
+#include <string.h>
+#include <unordered_map>
+
+#define MINWORD 4
+#define WINDOW_SIZE 20
+
+typedef void (*ss_match_fn)(CPUState *env, target_ulong pc, target_ulong addr,
+                            const char *search);
+
+struct ss_windows {
+    unsigned int ridx;
+    uint8_t read_window[WINDOW_SIZE];
+    unsigned int widx;
+    uint8_t write_window[WINDOW_SIZE];
+};
+
+static ss_match_fn ss_matcher;
+static std::unordered_map<target_ulong,ss_windows> ss_proc_windows;
+static ss_windows *ss_cur_windows = &ss_proc_windows[0];
+
+static bool ss_filtering = false;
+static target_ulong ss_target_asid = 0;
+static const char *ss_target_proc = NULL;
+static bool ss_target_running = true;
+static bool ss_check_target = false;
+static bool ss_memcb_on = false;
+
+static int ss_mem_callback(CPUState *env, target_ulong pc, target_ulong addr,
+                           target_ulong size, void *buf, bool is_write,
+                           uint8_t (&window)[WINDOW_SIZE]) {
+    if (!instr_range_active() || !ss_target_running) return 1;
+    unsigned int idx;
+    if (is_write) idx = ss_cur_windows->widx;
+    else idx = ss_cur_windows->ridx;
+    for (unsigned int i = 0; i < size; i++) {
+        uint8_t val = ((uint8_t *)buf)[i];
+        // Hack: skip NULLs to get free UTF-16 support
+        // Also skip punctuation
+        switch (val) {
+            case 0: case '!': case '"': case '#': case '$':
+            case '%': case '&': case '\'': case '(': case ')':
+            case '*': case '+': case ',': case '-': case '.':
+            case '/': case ':': case ';': case '<': case '=':
+            case '>': case '?': case '@': case '[': case '\\':
+            case ']': case '^': case '_': case '`': case '{':
+            case '|': case '}': case '~':
+                continue;
+        }
+
+        if ('a' <= val && val <= 'z') val &= ~0x20;
+        window[idx++] = val;
+        if (idx >= WINDOW_SIZE) idx -= WINDOW_SIZE;
+    }
+
+    char search[WINDOW_SIZE+1] = {};
+    memcpy(search, window+idx, WINDOW_SIZE-idx);
+    memcpy(search+(WINDOW_SIZE-idx), window, idx);
+    ss_matcher(env, pc, addr, search);
+
+    if (is_write) ss_cur_windows->widx = idx;
+    else ss_cur_windows->ridx = idx;
+    return 1;
+}
+
+static int ss_mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr,
+                                target_ulong size, void *buf) {
+    STATS_CALLBACK(virt_mem_read);
+    return ss_mem_callback(env, pc, addr, size, buf, false, ss_cur_windows->read_window);
+}
+
+static int ss_mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr,
+                                 target_ulong size, void *buf) {
+    STATS_CALLBACK(virt_mem_write);
+    return ss_mem_callback(env, pc, addr, size, buf, true, ss_cur_windows->write_window);
+}
+
+// Memory callbacks are only switched on inside the instruction range and
+// while the target is running. Already-translated code has to be flushed
+// for a change to take effect.
+static void ss_update_memcb() {
+    bool want = instr_range_active() && ss_target_running;
+    if (want == ss_memcb_on) return;
+    if (want) panda_enable_memcb();
+    else panda_disable_memcb();
+    panda_do_flush_tb();
+    ss_memcb_on = want;
+}
+
+static bool ss_is_target(CPUState *env, target_ulong asid) {
+    if (!ss_target_proc) return asid == ss_target_asid;
+    OsiProc *proc = get_current_process(env);
+    bool match = proc && proc->asid == asid && !strcmp(proc->name, ss_target_proc);
+    free_osiproc(proc);
+    return match;
+}
+
+static int ss_pgd_changed_callback(CPUState *env, target_ulong oldval, target_ulong newval) {
+    STATS_CALLBACK(vmi_pgd_changed);
+    ss_cur_windows = &ss_proc_windows[newval];
+    if (!ss_filtering) return 0;
+    if (ss_target_proc) {
+        // The OS may not have switched its idea of the current process
+        // yet; wait for the first block in the new address space
+        ss_check_target = true;
+        return 0;
+    }
+    ss_target_running = ss_is_target(env, newval);
+    ss_update_memcb();
+    return 0;
+}
+
+static int ss_before_block_exec(CPUState *env, TranslationBlock *tb) {
+    if (!ss_check_target) return 0;
+    ss_check_target = false;
+    ss_target_running = ss_is_target(env, panda_current_asid(env));
+    ss_update_memcb();
+    return 0;
+}
+
+static void ss_start_search(void *self) {
+    panda_cb pcb;
+
+    pcb.virt_mem_write = ss_mem_write_callback;
+    panda_register_callback(self, PANDA_CB_VIRT_MEM_WRITE, pcb);
+    pcb.virt_mem_read = ss_mem_read_callback;
+    panda_register_callback(self, PANDA_CB_VIRT_MEM_READ, pcb);
+
+    // Enable memory logging
+    ss_update_memcb();
+}
+
+static void ss_stop_search(void *self) {
+    ss_update_memcb();
+}
+
+static bool ss_search_init(void *self, const char *plugin, panda_arg_list *args,
+                           ss_match_fn match) {
+    ss_matcher = match;
+
+    panda_cb pcb;
+    ss_target_asid = panda_parse_ulong(args, "asid", 0);
+    ss_target_proc = panda_parse_string(args, "proc", NULL);
+    if (ss_target_proc) {
+        panda_require("osi");
+        if (!init_osi_api()) return false;
+    }
+    if (ss_target_asid || ss_target_proc) {
+        // Unknown until the first block runs
+        ss_filtering = true;
+        ss_target_running = false;
+        ss_check_target = true;
+        pcb.before_block_exec = ss_before_block_exec;
+        panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
+        if (ss_target_proc) printf("Only searching memory in process %s\n", ss_target_proc);
+        else printf("Only searching memory in address space " TARGET_FMT_lx "\n", ss_target_asid);
+    }
+    pcb.vmi_pgd_changed = ss_pgd_changed_callback;
+    panda_register_callback(self, PANDA_CB_VMI_PGD_CHANGED, pcb);
+
+    return instr_range_init(self, plugin, args, ss_start_search, ss_stop_search);
+}
+
+#endif
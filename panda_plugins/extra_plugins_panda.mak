@@ -21,6 +21,15 @@ QEMU_CFLAGS+=-I$(SRC_PATH)/$(TARGET_DIR) -I$(TARGET_PATH) -DNEED_CPU_H -fPIC
 QEMU_CFLAGS+=-I$(SRC_PATH)/panda_plugins
 QEMU_CFLAGS+=$(GLIB_CFLAGS)
 
+# Headers shared between plugins in this repo
+QEMU_CFLAGS+=-I$(PLUGIN_SRC_ROOT)/common
+
+# make PLUGIN_STATS=1 builds plugins with callback latency and memory
+# accounting (see common/plugin_stats.h)
+ifdef PLUGIN_STATS
+QEMU_CFLAGS+=-DPLUGIN_STATS
+endif
+
 PLUGIN_OBJ_DIR=$(PLUGIN_TARGET_DIR)/panda_$(PLUGIN_NAME)
 
 $(PLUGIN_OBJ_DIR):
@@ -40,3 +49,83 @@ $(PLUGIN_TARGET_DIR)/%.o: %.c
 $(PLUGIN_TARGET_DIR)/%.o: %.cpp $(GENERATED_HEADERS)
 	$(call quiet-command,$(CXX) $(filter-out -Wnested-externs -Wmissing-prototypes -Wstrict-prototypes -Wold-style-declaration -Wold-style-definition, $(QEMU_INCLUDES) $(QEMU_CFLAGS) $(QEMU_CXXFLAGS) $(QEMU_DGFLAGS) $(CXXFLAGS)) -c -o $@ $<,"  CXX   $@")
 
+
+# Profile-guided and link-time optimized builds. PLUGIN_BUILD selects how
+# panda_<name>.so is compiled:
+#
+#   (unset)     the normal build
+#   instrument  -fprofile-generate; running the plugin writes profiles to
+#               $(PGO_DIR)
+#   optimized   -fprofile-use -flto, and only init_plugin/uninit_plugin
+#               are exported, so everything else can be inlined or dropped
+#
+# Usually driven through the targets below, from a plugin's directory:
+#
+#   make train PGO_REPLAY=<recording> [PGO_ARGS=...] [PGO_PLUGINS=...]
+#   make optimized
+#   make pgo-report PGO_REPLAY=<recording> ...
+#
+# The workload is a replay of PGO_REPLAY with the plugin loaded with
+# PGO_ARGS; PGO_PLUGINS are loaded before it (e.g. "osi;win7x86intro"), and
+# PGO_QEMU_ARGS are passed to QEMU (e.g. "-m 1024").
+
+PGO_DIR ?= $(PLUGIN_TARGET_DIR)/pgo/$(PLUGIN_NAME)
+
+ifeq ($(PLUGIN_BUILD),instrument)
+QEMU_CFLAGS+=-fprofile-generate=$(PGO_DIR) -fprofile-update=atomic
+else ifeq ($(PLUGIN_BUILD),optimized)
+QEMU_CFLAGS+=-fprofile-use=$(PGO_DIR) -fprofile-correction -Wno-missing-profile -flto=auto
+LIBS+=-Wl,--version-script=$(PLUGIN_SRC_ROOT)/plugin.map
+else ifneq ($(PLUGIN_BUILD),)
+$(error Unknown PLUGIN_BUILD $(PLUGIN_BUILD): use instrument or optimized)
+endif
+
+# Rebuild the plugin's object whenever PLUGIN_BUILD changes. The stamp is
+# only rewritten when the mode differs from the last build.
+PLUGIN_MODE_STAMP=$(PLUGIN_TARGET_DIR)/panda_$(PLUGIN_NAME).mode
+
+$(PLUGIN_MODE_STAMP): FORCE
+	@[ -d  $(dir $@) ] || mkdir -p $(dir $@)
+	@[ "`cat $@ 2>/dev/null`" = "mode:$(PLUGIN_BUILD)" ] || echo "mode:$(PLUGIN_BUILD)" > $@
+
+$(PLUGIN_TARGET_DIR)/$(PLUGIN_NAME).o: $(PLUGIN_MODE_STAMP)
+
+PGO_QEMU ?= $(SRC_PATH)/$(TARGET_DIR)qemu-system-$(TARGET_ARCH)
+PGO_QEMU_ARGS ?=
+PGO_REPLAY ?=
+PGO_ARGS ?=
+PGO_PLUGINS ?=
+PGO_RUNS ?= 3
+PGO_WORKDIR ?= $(PLUGIN_TARGET_DIR)/pgo/$(PLUGIN_NAME)-run
+PGO_RUN = mkdir -p $(PGO_WORKDIR) && cd $(PGO_WORKDIR) && \
+	$(PGO_QEMU) $(PGO_QEMU_ARGS) -replay $(abspath $(PGO_REPLAY)) \
+	-panda '$(if $(PGO_PLUGINS),$(PGO_PLUGINS);)$(PLUGIN_NAME)$(if $(PGO_ARGS),:$(PGO_ARGS))'
+
+pgo-check-replay:
+	@[ -n "$(PGO_REPLAY)" ] || { echo "Set PGO_REPLAY to the recording to train on"; exit 1; }
+
+instrument:
+	rm -rf $(PGO_DIR)
+	$(MAKE) PLUGIN_BUILD=instrument all
+
+train: pgo-check-replay instrument
+	$(PGO_RUN)
+	@[ -d $(PGO_DIR) ] || { echo "No profiles were written to $(PGO_DIR)"; exit 1; }
+
+optimized:
+	@[ -d $(PGO_DIR) ] || { echo "No profiles in $(PGO_DIR); run make train first"; exit 1; }
+	$(MAKE) PLUGIN_BUILD=optimized all
+
+# Time the workload with a normal build and with the optimized one (best
+# of PGO_RUNS each). Leaves the optimized build installed.
+pgo-report: pgo-check-replay
+	@[ -d $(PGO_DIR) ] || { echo "No profiles in $(PGO_DIR); run make train first"; exit 1; }
+	$(MAKE) PLUGIN_BUILD= all
+	@base=`$(PLUGIN_SRC_ROOT)/pgo_time.sh $(PGO_RUNS) "$(PGO_RUN)"` && \
+	$(MAKE) PLUGIN_BUILD=optimized all && \
+	opt=`$(PLUGIN_SRC_ROOT)/pgo_time.sh $(PGO_RUNS) "$(PGO_RUN)"` && \
+	echo "$$base $$opt" | awk '{ printf "$(PLUGIN_NAME): normal %.2fs, PGO+LTO %.2fs, speedup %.3fx\n", $$1, $$2, $$1 / $$2 }'
+
+FORCE:
+
+.PHONY: FORCE pgo-check-replay instrument train optimized pgo-report
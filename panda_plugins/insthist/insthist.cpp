@@ -27,10 +27,40 @@ extern "C" {
 
 }
 
-#include <map>
-#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "insthist_fmt.h"
+#include "plugin_stats.h"
+#include "instr_range.h"
 
-typedef std::map<std::string,int> instr_hist;
+#ifdef TARGET_I386
+#define NUM_INSNS X86_INS_ENDING
+#elif defined(TARGET_ARM)
+#define NUM_INSNS ARM_INS_ENDING
+#endif
+
+// Mnemonic histogram of a single block, as (capstone instruction ID, count)
+// pairs. Blocks only use a handful of distinct instructions, so this is far
+// smaller (and quicker to add to the window) than a dense array per block.
+struct insn_count {
+    uint16_t id;
+    uint16_t count;
+};
+typedef std::vector<insn_count> instr_hist;
 
 
 // These need to be extern "C" so that the ABI is compatible with
@@ -42,142 +72,825 @@ void uninit_plugin(void *);
 
 }
 
-#define WINDOW_SIZE 100
+#ifdef TARGET_I386
+#define CS_ARCH CS_ARCH_X86
+#define NUM_MODES 3
+const cs_mode cs_modes[NUM_MODES] = { CS_MODE_16, CS_MODE_32, CS_MODE_64 };
+#elif defined(TARGET_ARM)
+#define CS_ARCH CS_ARCH_ARM
+#define NUM_MODES 2
+const cs_mode cs_modes[NUM_MODES] = { CS_MODE_ARM, CS_MODE_THUMB };
+#endif
 
-csh handle;
-cs_insn *insn;
-bool init_capstone_done = false;
+// One capstone handle (and one reusable instruction buffer) per CPU mode,
+// all opened up front so mixed-mode guests disassemble correctly
+csh handles[NUM_MODES];
+cs_insn *insns[NUM_MODES];
 target_ulong asid;
 int sample_rate = 100;
 FILE *histlog;
+bool binary_output = false;
+
+#define NO_PROFILE 0xFFFFFFFF
+
+// Mnemonic histogram and instruction count of a block of code. Profiles
+// are never changed once made: if a PC is retranslated into different
+// code it gets a new profile (a new generation), and anything still
+// referring to the old one keeps subtracting exactly what it added.
+struct block_profile {
+    uint64_t code_hash;
+    uint16_t size;
+    uint8_t mode;
+    // Disassembled this run, so it should be added to the cache file
+    bool is_new;
+    uint32_t ninsns;
+    instr_hist hist;
+};
+std::vector<block_profile> profiles;
+
+// Code hash => profile index. Blocks with the same code (at any PC) share
+// a profile, and a PC retranslated into different code hashes differently.
+std::unordered_map<uint64_t,uint32_t> code_hists;
+
+// Hot block profile (hotblocks=): execution and instruction counts per
+// (ASID, PC), kept in an open-addressing table. An entry with execs == 0
+// is empty. Only every hot_sample'th block is counted, weighted by
+// hot_sample, to bound the overhead.
+struct hot_block {
+    uint64_t asid;
+    uint64_t pc;
+    uint64_t execs;
+    uint64_t insns;
+};
+const char *hot_file = NULL;
+uint32_t hot_sample = 1;
+uint32_t hot_countdown = 1;
+std::vector<hot_block> hot_table;
+size_t hot_used = 0;
+
+// Persistent disassembly cache, mmapped read-only at init_plugin and
+// indexed by code hash. New profiles are appended at uninit_plugin.
+const char *cache_file = NULL;
+uint8_t *cache_map = NULL;
+size_t cache_map_size = 0;
+std::unordered_map<uint64_t,const insthist_cache_entry *> cache_index;
+
+// TB => profile index of the code it was translated from, filled in by
+// after_block_translate so before_block_exec never has to look up the PC.
+// Open addressing keyed on the TB pointer; TBs live in a fixed array in
+// QEMU, so the table never holds more keys than there are TBs and entries
+// are never removed, just set to NO_PROFILE.
+struct tb_slot {
+    TranslationBlock *tb;
+    uint32_t prof;
+};
+std::vector<tb_slot> tb_table(4096);
+size_t tb_table_used = 0;
+
+// One sliding window over the last `size` blocks
+struct hist_window {
+    uint64_t size;
+    uint64_t insns;
+    // Rolling histogram, indexed by capstone instruction ID
+    uint32_t hist[NUM_INSNS];
+};
+
+std::vector<uint64_t> window_sizes;
+uint64_t max_window = 0;
+
+// Windows and sample stream for one address space (or for everything, when
+// we're not splitting by ASID).
+struct proc_state {
+    target_ulong asid;
+    std::vector<hist_window> windows;
+    // Profile indices of the last max_window blocks, shared by all windows.
+    // Block t is in ring[t % max_window]; a window of size W drops block
+    // t-W. Grown on demand so short-lived processes stay small.
+    std::vector<uint32_t> ring;
+    uint64_t bbcount;
+};
+
+// Used when not in multi-ASID mode
+proc_state single_state;
+
+// Multi-ASID mode: ASID => state. cur_state caches the lookup for the ASID
+// we last ran in, so the map is only consulted on a context switch.
+bool multi_asid = false;
+bool all_asids = false;
+std::unordered_set<target_ulong> wanted_asids;
+std::unordered_map<target_ulong,proc_state *> proc_states;
+proc_state *cur_state = NULL;
+target_ulong cur_asid = 0;
+bool cur_valid = false;
+
+// Double-buffered writer for the binary sample stream. Samples are
+// appended to the front buffer on the emulation thread; when it fills up
+// it is swapped with the back buffer and a background thread compresses
+// and writes it out while the replay carries on.
+#define CHUNK_SIZE (1 << 20)
+
+std::vector<uint8_t> chunk_bufs[2];
+int front = 0;
+bool back_full = false;
+bool writer_stop = false;
+bool compress_chunks = false;
+std::mutex writer_lock;
+std::condition_variable writer_cv;
+std::thread writer;
+
+static void write_chunk(std::vector<uint8_t> &buf) {
+    insthist_chunk ch;
+    ch.raw_size = buf.size();
+    if (compress_chunks) {
+        uLongf zlen = compressBound(buf.size());
+        std::vector<uint8_t> z(zlen);
+        if (compress2(z.data(), &zlen, buf.data(), buf.size(), Z_BEST_SPEED) != Z_OK) {
+            printf("insthist: compress2 failed, dropping %zu bytes of samples\n", buf.size());
+            return;
+        }
+        ch.stored_size = zlen;
+        fwrite(&ch, sizeof(ch), 1, histlog);
+        fwrite(z.data(), zlen, 1, histlog);
+    }
+    else {
+        ch.stored_size = ch.raw_size;
+        fwrite(&ch, sizeof(ch), 1, histlog);
+        fwrite(buf.data(), buf.size(), 1, histlog);
+    }
+}
 
-// PC => Mnemonic histogram
-std::map<target_ulong,instr_hist> code_hists;
+static void writer_thread() {
+    std::unique_lock<std::mutex> lk(writer_lock);
+    while (true) {
+        writer_cv.wait(lk, []{ return back_full || writer_stop; });
+        if (!back_full) break;
+        std::vector<uint8_t> &buf = chunk_bufs[front ^ 1];
+        lk.unlock();
+        write_chunk(buf);
+        buf.clear();
+        lk.lock();
+        back_full = false;
+        writer_cv.notify_all();
+    }
+}
 
-// PC => number of instructions in the TB
-std::map<target_ulong,int> tb_insns;
+// Hand the front buffer to the writer thread
+static void flush_chunk() {
+    if (chunk_bufs[front].empty()) return;
+    std::unique_lock<std::mutex> lk(writer_lock);
+    writer_cv.wait(lk, []{ return !back_full; });
+    front ^= 1;
+    back_full = true;
+    writer_cv.notify_all();
+}
 
-// Circular buffer PCs in the window
-target_ulong window[WINDOW_SIZE] = {};
+static void write_header() {
+    insthist_header hdr;
+    memcpy(hdr.magic, INSTHIST_MAGIC, sizeof(hdr.magic));
+    hdr.version = INSTHIST_VERSION;
+    hdr.flags = compress_chunks ? INSTHIST_FLAG_ZLIB : 0;
+    if (multi_asid) hdr.flags |= INSTHIST_FLAG_ASID;
+    hdr.num_windows = window_sizes.size();
+    hdr.num_ids = NUM_INSNS;
+    fwrite(&hdr, sizeof(hdr), 1, histlog);
+    for (uint64_t size : window_sizes)
+        fwrite(&size, sizeof(size), 1, histlog);
+
+    // Instruction IDs (and names) are the same in every mode
+    for (unsigned id = 0; id < NUM_INSNS; id++) {
+        const char *mnem = cs_insn_name(handles[0], id);
+        uint16_t len = mnem ? strlen(mnem) : 0;
+        fwrite(&len, sizeof(len), 1, histlog);
+        if (len) fwrite(mnem, len, 1, histlog);
+    }
+}
 
-// Rolling histogram of PCs
-instr_hist window_hist;
-uint64_t window_insns = 0;
-uint64_t bbcount = 0;
+static bool init_capstone() {
+    for (int m = 0; m < NUM_MODES; m++) {
+        if (cs_open(CS_ARCH, cs_modes[m], &handles[m]) != CS_ERR_OK) {
+            printf("Error initializing capstone\n");
+            return false;
+        }
+        cs_option(handles[m], CS_OPT_DETAIL, CS_OPT_OFF);
+        insns[m] = cs_malloc(handles[m]);
+    }
+    return true;
+}
 
-void init_capstone(CPUState *env) {
-    cs_arch arch;
-    cs_mode mode;
+// Index into handles[] for the mode the CPU is executing in right now
+static inline int cpu_mode(CPUState *env) {
 #ifdef TARGET_I386
-    arch = CS_ARCH_X86;
-    mode = env->hflags & HF_LMA_MASK ? CS_MODE_64 : CS_MODE_32;
+    if (env->hflags & HF_CS64_MASK) return 2;
+    return (env->hflags & HF_CS32_MASK) ? 1 : 0;
 #elif defined(TARGET_ARM)
-    arch = CS_ARCH_ARM;
-    mode = env->thumb ? CS_MODE_THUMB : CS_MODE_ARM;
+    return env->thumb ? 1 : 0;
 #endif
+}
 
-    if (cs_open(arch, mode, &handle) != CS_ERR_OK) {
-        printf("Error initializing capstone\n");
-    }
-    init_capstone_done = true;
+static inline void add_hist(uint32_t *a, const instr_hist &b) {
+    for (auto &ic : b) a[ic.id] += ic.count;
 }
 
-void add_hist(instr_hist &a, instr_hist &b) {
-    for (auto &kvp : b) a[kvp.first] += kvp.second;
+static inline void sub_hist(uint32_t *a, const instr_hist &b) {
+    for (auto &ic : b) a[ic.id] -= ic.count;
 }
 
-void sub_hist(instr_hist &a, instr_hist &b) {
-    for (auto &kvp : b) a[kvp.first] -= kvp.second;
+void write_sample(proc_state &ps, hist_window &w) {
+    std::vector<uint8_t> &buf = chunk_bufs[front];
+    size_t start = buf.size();
+    buf.resize(start + sizeof(insthist_sample) + NUM_INSNS * sizeof(insthist_entry));
+
+    insthist_sample *smp = (insthist_sample *)&buf[start];
+    insthist_entry *ent = (insthist_entry *)(smp + 1);
+    smp->instr_count = rr_get_guest_instr_count();
+    smp->asid = ps.asid;
+    smp->window_insns = w.insns;
+    smp->window = &w - &ps.windows[0];
+    smp->nnz = 0;
+    for (unsigned id = 0; id < NUM_INSNS; id++) {
+        if (w.hist[id]) {
+            ent[smp->nnz].id = id;
+            ent[smp->nnz].count = w.hist[id];
+            smp->nnz++;
+        }
+    }
+    buf.resize(start + sizeof(insthist_sample) + smp->nnz * sizeof(insthist_entry));
+
+    if (buf.size() >= CHUNK_SIZE) flush_chunk();
 }
 
-void print_hist(instr_hist &ih, uint64_t window_insns) { 
+void print_hist(proc_state &ps, hist_window &w) {
+    if (binary_output) {
+        write_sample(ps, w);
+        return;
+    }
+
     fprintf(histlog, "%" PRIu64 " ", rr_get_guest_instr_count());
+    if (multi_asid)
+        fprintf(histlog, "a%" PRIx64 " ", (uint64_t)ps.asid);
+    // Only tag lines with the window size when there's more than one
+    if (window_sizes.size() > 1)
+        fprintf(histlog, "w%" PRIu64 " ", w.size);
     fprintf(histlog, "{");
-    for (auto &kvp : ih) {
+    for (unsigned id = 0; id < NUM_INSNS; id++) {
         // Don't print the mnemonic if it wasn't seen. Saves log space.
-        if (kvp.second)
-            fprintf (histlog, "\"%s\": %f, ", kvp.first.c_str(), kvp.second/(float)window_insns);
+        if (w.hist[id])
+            fprintf (histlog, "\"%s\": %f, ", cs_insn_name(handles[0], id), w.hist[id]/(float)w.insns);
     }
     fprintf(histlog, "}\n");
 }
 
-// During retranslation we may end up with different
-// instructions. Since we don't have TB generations we just
-// remove it from the rolling histogram first.
-void clear_hist(target_ulong pc) {
-    for (int i = 0; i < WINDOW_SIZE; i++) {
-        if (window[i] == pc) {
-            window[i] = 0;
-            window_insns -= tb_insns[pc];
-            sub_hist(window_hist, code_hists[pc]);
+// FNV-1a, used to tell whether a retranslated PC still has the same code.
+// The CPU mode is mixed in since the same bytes decode differently.
+static uint64_t hash_bytes(const uint8_t *buf, size_t len, int mode) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ mode;
+    for (size_t i = 0; i < len; i++) {
+        h ^= buf[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static inline size_t tb_hash(TranslationBlock *tb) {
+    return (((uintptr_t)tb) >> 4) * 0x9E3779B97F4A7C15ULL >> 20;
+}
+
+static inline uint32_t tb_profile(TranslationBlock *tb) {
+    size_t mask = tb_table.size() - 1;
+    for (size_t i = tb_hash(tb) & mask; tb_table[i].tb; i = (i + 1) & mask) {
+        if (tb_table[i].tb == tb) return tb_table[i].prof;
+    }
+    return NO_PROFILE;
+}
+
+static void tb_set_profile(TranslationBlock *tb, uint32_t prof) {
+    size_t mask = tb_table.size() - 1;
+    size_t i;
+    for (i = tb_hash(tb) & mask; tb_table[i].tb; i = (i + 1) & mask) {
+        if (tb_table[i].tb == tb) {
+            tb_table[i].prof = prof;
+            return;
         }
     }
+    // Not there yet; nothing to forget if we weren't going to remember it
+    if (prof == NO_PROFILE) return;
+
+    if (2 * (tb_table_used + 1) > tb_table.size()) {
+        std::vector<tb_slot> old(tb_table.size() * 2);
+        old.swap(tb_table);
+        tb_table_used = 0;
+        for (auto &slot : old) {
+            if (slot.tb) tb_set_profile(slot.tb, slot.prof);
+        }
+        tb_set_profile(tb, prof);
+        return;
+    }
+    tb_table[i].tb = tb;
+    tb_table[i].prof = prof;
+    tb_table_used++;
+}
+
+static void init_state(proc_state &ps, target_ulong asid) {
+    ps.asid = asid;
+    ps.bbcount = 0;
+    for (uint64_t size : window_sizes) {
+        hist_window w = {};
+        w.size = size;
+        ps.windows.push_back(w);
+    }
+}
+
+// Look up (or start) the state for a newly switched-to ASID. NULL if we
+// aren't following it.
+static proc_state *switch_state(target_ulong asid) {
+    auto it = proc_states.find(asid);
+    if (it != proc_states.end()) return it->second;
+    if (!all_asids && wanted_asids.find(asid) == wanted_asids.end()) return NULL;
+    proc_state *ps = new proc_state;
+    init_state(*ps, asid);
+    proc_states[asid] = ps;
+    return ps;
+}
+
+static inline proc_state *current_state(CPUState *env) {
+    if (!multi_asid)
+        return (asid && panda_current_asid(env) != asid) ? NULL : &single_state;
+
+    target_ulong a = panda_current_asid(env);
+    if (!cur_valid || a != cur_asid) {
+        cur_state = switch_state(a);
+        cur_asid = a;
+        cur_valid = true;
+    }
+    return cur_state;
 }
 
 static int after_block_translate(CPUState *env, TranslationBlock *tb) {
+    STATS_CALLBACK(after_block_translate);
+    if (!instr_range_active()) return 0;
     size_t count;
-    uint8_t mem[1024] = {};
-
-    if (asid && panda_current_asid(env) != asid) return 0;
+    // Big enough for any TB (tb->size is 16 bits), and at most one
+    // instruction per byte. Translation is single-threaded.
+    static uint8_t mem[1 << 16];
+    static uint16_t ids[1 << 16];
+
+    // In multi-ASID mode every block gets a profile, since code such as the
+    // kernel's may be translated in one process and run in another.
+    if (!multi_asid && asid && panda_current_asid(env) != asid) {
+        // This TB may be a recycled one we had a profile for
+        tb_set_profile(tb, NO_PROFILE);
+        return 0;
+    }
 
-    if (!init_capstone_done) init_capstone(env);
+    int mode = cpu_mode(env);
+    size_t code_size = tb->size;
+    memset(mem, 0, code_size);
+    panda_virtual_memory_rw(env, tb->pc, mem, code_size, false);
+    uint64_t code_hash = hash_bytes(mem, code_size, mode);
+
+    auto it = code_hists.find(code_hash);
+    if (it != code_hists.end()) {
+        const block_profile &p = profiles[it->second];
+        if (p.size == code_size && p.mode == mode) {
+            // Seen this code before, no need to disassemble again
+            tb_set_profile(tb, it->second);
+            return 0;
+        }
+    }
 
-    if (code_hists.find(tb->pc) != code_hists.end()) {
-        clear_hist(tb->pc);
+    auto cit = cache_index.find(code_hash);
+    if (cit != cache_index.end() && cit->second->size == code_size && cit->second->mode == mode) {
+        const insthist_cache_entry *ent = cit->second;
+        const insthist_cache_pair *pairs = (const insthist_cache_pair *)(ent + 1);
+        profiles.emplace_back();
+        block_profile &prof = profiles.back();
+        prof.code_hash = code_hash;
+        prof.size = code_size;
+        prof.mode = mode;
+        prof.is_new = false;
+        prof.ninsns = ent->ninsns;
+        for (uint32_t i = 0; i < ent->npairs; i++)
+            prof.hist.push_back({pairs[i].id, pairs[i].count});
+
+        uint32_t idx = profiles.size() - 1;
+        code_hists[code_hash] = idx;
+        tb_set_profile(tb, idx);
         return 0;
     }
 
-    panda_virtual_memory_rw(env, tb->pc, mem, tb->size, false);
-    count = cs_disasm_ex(handle, mem, tb->size, tb->pc, 0, &insn);
-    for (unsigned i = 0; i < count; i++)
-        code_hists[tb->pc][insn[i].mnemonic]++;
-    tb_insns[tb->pc] = count;
+    uint16_t size = code_size;
+    const uint8_t *code = mem;
+    uint64_t addr = tb->pc;
+    count = 0;
+    while (cs_disasm_iter(handles[mode], &code, &code_size, &addr, insns[mode]))
+        ids[count++] = insns[mode]->id;
+    std::sort(ids, ids + count);
+
+    profiles.emplace_back();
+    block_profile &prof = profiles.back();
+    prof.code_hash = code_hash;
+    prof.size = size;
+    prof.mode = mode;
+    prof.is_new = true;
+    for (unsigned i = 0; i < count; i++) {
+        if (prof.hist.empty() || prof.hist.back().id != ids[i])
+            prof.hist.push_back({ids[i], 0});
+        prof.hist.back().count++;
+    }
+    prof.ninsns = count;
+
+    uint32_t idx = profiles.size() - 1;
+    code_hists[code_hash] = idx;
+    tb_set_profile(tb, idx);
     return 1;
 }
 
-static int before_block_exec(CPUState *env, TranslationBlock *tb) {
-    if (asid && panda_current_asid(env) != asid) return 0;
+static inline size_t hot_hash(uint64_t asid, uint64_t pc) {
+    return ((pc ^ (asid * 0xff51afd7ed558ccdULL)) * 0x9E3779B97F4A7C15ULL) >> 16;
+}
+
+static void hot_add(uint64_t asid, uint64_t pc, uint64_t execs, uint64_t insns) {
+    if (2 * (hot_used + 1) > hot_table.size()) {
+        std::vector<hot_block> old(hot_table.size() * 2);
+        old.swap(hot_table);
+        hot_used = 0;
+        for (auto &hb : old) {
+            if (hb.execs) hot_add(hb.asid, hb.pc, hb.execs, hb.insns);
+        }
+    }
+    size_t mask = hot_table.size() - 1;
+    size_t i;
+    for (i = hot_hash(asid, pc) & mask; hot_table[i].execs; i = (i + 1) & mask) {
+        if (hot_table[i].pc == pc && hot_table[i].asid == asid) break;
+    }
+    hot_block &hb = hot_table[i];
+    if (!hb.execs) {
+        hb.asid = asid;
+        hb.pc = pc;
+        hot_used++;
+    }
+    hb.execs += execs;
+    hb.insns += insns;
+}
+
+#ifdef PLUGIN_STATS
+// Approximate footprints for the stats dump. Hash map nodes are counted
+// as key + value + next pointer.
+static size_t profile_bytes(void) {
+    size_t n = profiles.capacity() * sizeof(block_profile);
+    for (auto &p : profiles) n += p.hist.capacity() * sizeof(insn_count);
+    n += code_hists.size() * (sizeof(uint64_t) + sizeof(uint32_t) + sizeof(void *));
+    n += code_hists.bucket_count() * sizeof(void *);
+    return n;
+}
+
+static size_t tb_table_bytes(void) {
+    return tb_table.capacity() * sizeof(tb_slot);
+}
+
+static size_t window_bytes(void) {
+    size_t n = 0;
+    auto state_bytes = [](const proc_state &ps) {
+        return ps.windows.capacity() * sizeof(hist_window) + ps.ring.capacity() * sizeof(uint32_t);
+    };
+    if (multi_asid) {
+        for (auto &kvp : proc_states) n += sizeof(proc_state) + state_bytes(*kvp.second);
+    }
+    else {
+        n += state_bytes(single_state);
+    }
+    return n;
+}
+
+static size_t hot_table_bytes(void) {
+    return hot_table.capacity() * sizeof(hot_block);
+}
+#endif
 
-    if (window[bbcount % WINDOW_SIZE] != 0) {
-        target_ulong old_pc = window[bbcount % WINDOW_SIZE];
-        window_insns -= tb_insns[old_pc];
-        sub_hist(window_hist, code_hists[old_pc]);
+// Write the hot block profile in folded-stack format, one line per block:
+//   asid_<asid>;<pc> <instructions>
+// which flamegraph.pl (and most other flame graph tools) take directly.
+static void write_hot_blocks() {
+    FILE *f = fopen(hot_file, "w");
+    if (!f) {
+        perror("fopen");
+        return;
+    }
+    std::vector<const hot_block *> blocks;
+    for (auto &hb : hot_table) {
+        if (hb.execs) blocks.push_back(&hb);
     }
+    std::sort(blocks.begin(), blocks.end(),
+            [](const hot_block *a, const hot_block *b) { return a->insns > b->insns; });
+    for (auto hb : blocks)
+        fprintf(f, "asid_%" PRIx64 ";0x%" PRIx64 " %" PRIu64 "\n", hb->asid, hb->pc, hb->insns);
+    fclose(f);
+    printf("insthist: wrote %zu hot blocks to %s\n", blocks.size(), hot_file);
+}
 
-    window[bbcount % WINDOW_SIZE] = tb->pc;
-    window_insns += tb_insns[tb->pc];
-    add_hist(window_hist, code_hists[tb->pc]);
+static int before_block_exec(CPUState *env, TranslationBlock *tb) {
+    STATS_CALLBACK(before_block_exec);
+    if (!instr_range_active()) return 0;
+    proc_state *ps = current_state(env);
+    if (!ps) return 0;
+
+    uint32_t idx = tb_profile(tb);
+    if (idx == NO_PROFILE) return 0;
+    const block_profile &prof = profiles[idx];
+
+    if (hot_file && --hot_countdown == 0) {
+        hot_countdown = hot_sample;
+        hot_add(multi_asid ? ps->asid : panda_current_asid(env), tb->pc,
+                hot_sample, (uint64_t)hot_sample * prof.ninsns);
+    }
+
+    uint64_t bbcount = ps->bbcount;
+    for (auto &w : ps->windows) {
+        if (bbcount >= w.size) {
+            const block_profile &old = profiles[ps->ring[(bbcount - w.size) % max_window]];
+            w.insns -= old.ninsns;
+            sub_hist(w.hist, old.hist);
+        }
+        w.insns += prof.ninsns;
+        add_hist(w.hist, prof.hist);
+    }
+    if (ps->ring.size() < max_window)
+        ps->ring.push_back(idx);
+    else
+        ps->ring[bbcount % max_window] = idx;
 
-    bbcount++;
+    ps->bbcount = ++bbcount;
 
     if (bbcount % sample_rate == 0) {
         // write out to the histlog
-        print_hist(window_hist, window_insns);
+        for (auto &w : ps->windows) print_hist(*ps, w);
     }
     return 1;
 }
 
-bool init_plugin(void *self) {
+static void fill_cache_header(insthist_cache_header &hdr) {
+    memcpy(hdr.magic, INSTHIST_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = INSTHIST_CACHE_VERSION;
+    hdr.arch = CS_ARCH;
+    hdr.cs_version = cs_version(NULL, NULL);
+    hdr.num_ids = NUM_INSNS;
+}
+
+// Map the cache file and index its entries. A missing or mismatched cache
+// isn't an error; we just start a fresh one.
+static void load_cache() {
+    int fd = open(cache_file, O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(insthist_cache_header)) {
+        cache_map_size = st.st_size;
+        cache_map = (uint8_t *)mmap(NULL, cache_map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (cache_map == MAP_FAILED) cache_map = NULL;
+    }
+    close(fd);
+    if (!cache_map) return;
+
+    insthist_cache_header want;
+    fill_cache_header(want);
+    if (memcmp(cache_map, &want, sizeof(want))) {
+        printf("insthist: %s was made by a different capstone or arch, ignoring it\n", cache_file);
+        return;
+    }
+
+    size_t off = sizeof(insthist_cache_header);
+    while (off + sizeof(insthist_cache_entry) <= cache_map_size) {
+        const insthist_cache_entry *ent = (const insthist_cache_entry *)(cache_map + off);
+        size_t len = sizeof(*ent) + ent->npairs * sizeof(insthist_cache_pair);
+        // A torn write from a run that died; ignore the rest
+        if (off + len > cache_map_size) break;
+        cache_index[ent->code_hash] = ent;
+        off += len;
+    }
+    printf("insthist: loaded %zu cached blocks from %s\n", cache_index.size(), cache_file);
+}
+
+static bool write_all(int fd, const uint8_t *buf, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Several replays may share a cache, so everything is done under an
+// exclusive flock and the file is never truncated in place. New entries
+// are appended with a single write. If the file on disk has no valid
+// header (new, or made by a different capstone or arch), a fresh cache is
+// written to a temp file and renamed over it.
+static void save_cache() {
+    std::vector<uint8_t> buf;
+    size_t nnew = 0;
+    for (auto &prof : profiles) {
+        if (!prof.is_new) continue;
+        insthist_cache_entry ent = {};
+        ent.code_hash = prof.code_hash;
+        ent.size = prof.size;
+        ent.mode = prof.mode;
+        ent.ninsns = prof.ninsns;
+        ent.npairs = prof.hist.size();
+        buf.insert(buf.end(), (uint8_t *)&ent, (uint8_t *)(&ent + 1));
+        for (auto &ic : prof.hist) {
+            insthist_cache_pair pair = { ic.id, ic.count };
+            buf.insert(buf.end(), (uint8_t *)&pair, (uint8_t *)(&pair + 1));
+        }
+        nnew++;
+    }
+    if (!nnew) return;
+
+    insthist_cache_header want;
+    fill_cache_header(want);
+
+    int fd;
+    while (true) {
+        fd = open(cache_file, O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) {
+            perror("open");
+            return;
+        }
+        flock(fd, LOCK_EX);
+        // Another run may have renamed a fresh cache into place while we
+        // waited for the lock; if so, lock that one instead
+        struct stat fst, pst;
+        if (fstat(fd, &fst) == 0 && stat(cache_file, &pst) == 0 &&
+            fst.st_dev == pst.st_dev && fst.st_ino == pst.st_ino)
+            break;
+        close(fd);
+    }
+
+    struct stat st;
+    insthist_cache_header hdr;
+    bool ok;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(hdr) &&
+        pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && !memcmp(&hdr, &want, sizeof(hdr))) {
+        ok = write_all(fd, buf.data(), buf.size());
+    }
+    else {
+        std::string tmp = std::string(cache_file) + ".tmp." + std::to_string(getpid());
+        int tfd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ok = tfd >= 0 &&
+             write_all(tfd, (uint8_t *)&want, sizeof(want)) &&
+             write_all(tfd, buf.data(), buf.size());
+        if (tfd >= 0 && close(tfd)) ok = false;
+        if (ok) ok = rename(tmp.c_str(), cache_file) == 0;
+        if (!ok) unlink(tmp.c_str());
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    if (!ok) {
+        printf("insthist: couldn't write %s: %s\n", cache_file, strerror(errno));
+        return;
+    }
+    printf("insthist: added %zu blocks to %s\n", nnew, cache_file);
+}
+
+// Parse a colon-separated list of window sizes, e.g. "100:10000:1000000"
+static bool parse_windows(const char *spec) {
+    const char *p = spec;
+    while (*p) {
+        char *end;
+        unsigned long long size = strtoull(p, &end, 0);
+        if (end == p || size == 0) {
+            printf("insthist: bad window size list '%s'\n", spec);
+            return false;
+        }
+        window_sizes.push_back(size);
+        max_window = std::max(max_window, (uint64_t)size);
+        p = (*end == ':') ? end + 1 : end;
+    }
+    return !window_sizes.empty();
+}
+
+// Parse the asids argument: "all", or a colon-separated list of ASIDs
+static bool parse_asids(const char *spec) {
+    multi_asid = true;
+    if (!strcmp(spec, "all")) {
+        all_asids = true;
+        return true;
+    }
+    const char *p = spec;
+    while (*p) {
+        char *end;
+        unsigned long long a = strtoull(p, &end, 0);
+        if (end == p) {
+            printf("insthist: bad ASID list '%s'\n", spec);
+            return false;
+        }
+        wanted_asids.insert(a);
+        p = (*end == ':') ? end + 1 : end;
+    }
+    return !wanted_asids.empty();
+}
+
+// Blocks translated before the start of the range never went through
+// after_block_translate, so flush them to get profiles for everything.
+static void start_profiling(void *self) {
     panda_cb pcb;
 
+    panda_do_flush_tb();
+    pcb.after_block_translate = after_block_translate;
+    panda_register_callback(self, PANDA_CB_AFTER_BLOCK_TRANSLATE, pcb);
+    pcb.before_block_exec = before_block_exec;
+    panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
+}
+
+bool init_plugin(void *self) {
     panda_arg_list *args = panda_get_args("insthist");
     const char *name = panda_parse_string(args, "name", "insthist");
     asid = panda_parse_ulong(args, "asid", 0);
+    const char *asid_spec = panda_parse_string(args, "asids", NULL);
     sample_rate = panda_parse_uint32(args, "sample_rate", 1000);
+    const char *window_spec = panda_parse_string(args, "windows", "100");
+
+    const char *format = panda_parse_string(args, "format", "text");
+    compress_chunks = panda_parse_bool(args, "compress");
+    cache_file = panda_parse_string(args, "cache", NULL);
+    hot_file = panda_parse_string(args, "hotblocks", NULL);
+    hot_sample = panda_parse_uint32(args, "hotblock_sample", 1);
+    if (hot_sample == 0) hot_sample = 1;
+    hot_countdown = hot_sample;
+    if (hot_file) hot_table.resize(1 << 16);
+    STATS_INIT(self, "insthist", args);
+    STATS_BYTES_FN("profiles", profile_bytes);
+    STATS_BYTES_FN("tb table", tb_table_bytes);
+    STATS_BYTES_FN("windows", window_bytes);
+    STATS_BYTES_FN("hot blocks", hot_table_bytes);
+
+    if (!parse_windows(window_spec)) return false;
+    if (asid_spec && !parse_asids(asid_spec)) return false;
+    if (!init_capstone()) return false;
+    if (cache_file) load_cache();
+    init_state(single_state, 0);
+
+    if (!strcmp(format, "binary")) {
+        binary_output = true;
+    }
+    else if (strcmp(format, "text")) {
+        printf("insthist: unknown output format '%s'\n", format);
+        return false;
+    }
 
     char fname[260];
-    sprintf(fname, "%s_insthist.txt", name);
-    histlog = fopen(fname, "w");
+    sprintf(fname, "%s_insthist.%s", name, binary_output ? "bin" : "txt");
+    histlog = fopen(fname, binary_output ? "wb" : "w");
+    if (!histlog) {
+        printf("Couldn't open %s for writing. Exiting.\n", fname);
+        return false;
+    }
 
-    pcb.after_block_translate = after_block_translate;
-    panda_register_callback(self, PANDA_CB_AFTER_BLOCK_TRANSLATE, pcb);
-    pcb.before_block_exec = before_block_exec;
-    panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
+    if (!instr_range_init(self, "insthist", args, start_profiling, NULL)) return false;
+
+    if (binary_output) {
+        write_header();
+        chunk_bufs[0].reserve(CHUNK_SIZE + sizeof(insthist_sample) + NUM_INSNS * sizeof(insthist_entry));
+        chunk_bufs[1].reserve(chunk_bufs[0].capacity());
+        writer = std::thread(writer_thread);
+    }
 
     return true;
 }
 
 void uninit_plugin(void *self) {
-    print_hist(window_hist, window_insns);
+    STATS_DUMP();
+    if (multi_asid) {
+        for (auto &kvp : proc_states) {
+            for (auto &w : kvp.second->windows) print_hist(*kvp.second, w);
+            delete kvp.second;
+        }
+    }
+    else {
+        for (auto &w : single_state.windows) print_hist(single_state, w);
+    }
+    if (binary_output) {
+        flush_chunk();
+        {
+            std::lock_guard<std::mutex> lk(writer_lock);
+            writer_stop = true;
+        }
+        writer_cv.notify_all();
+        writer.join();
+    }
     fclose(histlog);
+
+    if (hot_file) write_hot_blocks();
+
+    if (cache_file) {
+        save_cache();
+        if (cache_map) munmap(cache_map, cache_map_size);
+    }
+
+    for (int m = 0; m < NUM_MODES; m++) {
+        cs_free(insns[m], 1);
+        cs_close(&handles[m]);
+    }
 }
@@ -0,0 +1,121 @@
+// Convert a binary insthist sample stream (format=binary) back into the
+// text format insthist writes by default.
+//
+// Usage: insthist2txt foo_insthist.bin > foo_insthist.txt
+
+#define __STDC_FORMAT_MACROS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#include "insthist_fmt.h"
+
+static bool read_exact(FILE *f, void *buf, size_t len) {
+    return len == 0 || fread(buf, len, 1, f) == 1;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <insthist.bin>\n", argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        perror("fopen");
+        return 1;
+    }
+
+    insthist_header hdr;
+    if (!read_exact(f, &hdr, sizeof(hdr)) || memcmp(hdr.magic, INSTHIST_MAGIC, sizeof(hdr.magic))) {
+        fprintf(stderr, "%s: not an insthist binary file\n", argv[1]);
+        return 1;
+    }
+    if (hdr.version != INSTHIST_VERSION && hdr.version != 1) {
+        fprintf(stderr, "%s: unsupported version %u\n", argv[1], hdr.version);
+        return 1;
+    }
+
+    std::vector<uint64_t> window_sizes(hdr.num_windows);
+    if (!read_exact(f, window_sizes.data(), hdr.num_windows * sizeof(uint64_t))) {
+        fprintf(stderr, "%s: truncated header\n", argv[1]);
+        return 1;
+    }
+
+    std::vector<std::string> names(hdr.num_ids);
+    for (uint32_t id = 0; id < hdr.num_ids; id++) {
+        uint16_t len;
+        char name[65536];
+        if (!read_exact(f, &len, sizeof(len)) || !read_exact(f, name, len)) {
+            fprintf(stderr, "%s: truncated name table\n", argv[1]);
+            return 1;
+        }
+        names[id].assign(name, len);
+    }
+
+    insthist_chunk ch;
+    std::vector<uint8_t> stored, raw;
+    while (read_exact(f, &ch, sizeof(ch))) {
+        stored.resize(ch.stored_size);
+        if (!read_exact(f, stored.data(), ch.stored_size)) {
+            fprintf(stderr, "%s: truncated chunk\n", argv[1]);
+            return 1;
+        }
+        if (hdr.flags & INSTHIST_FLAG_ZLIB) {
+            raw.resize(ch.raw_size);
+            uLongf rlen = ch.raw_size;
+            if (uncompress(raw.data(), &rlen, stored.data(), stored.size()) != Z_OK || rlen != ch.raw_size) {
+                fprintf(stderr, "%s: corrupt chunk\n", argv[1]);
+                return 1;
+            }
+        }
+        else {
+            raw.swap(stored);
+        }
+
+        size_t off = 0;
+        size_t smp_size = hdr.version == 1 ? sizeof(insthist_sample_v1) : sizeof(insthist_sample);
+        while (off + smp_size <= raw.size()) {
+            insthist_sample smp;
+            if (hdr.version == 1) {
+                insthist_sample_v1 *v1 = (insthist_sample_v1 *)&raw[off];
+                smp.instr_count = v1->instr_count;
+                smp.asid = 0;
+                smp.window_insns = v1->window_insns;
+                smp.window = v1->window;
+                smp.nnz = v1->nnz;
+            }
+            else {
+                memcpy(&smp, &raw[off], sizeof(smp));
+            }
+            insthist_entry *ent = (insthist_entry *)&raw[off + smp_size];
+            off += smp_size + smp.nnz * sizeof(insthist_entry);
+            if (off > raw.size() || smp.window >= hdr.num_windows) {
+                fprintf(stderr, "%s: corrupt sample\n", argv[1]);
+                return 1;
+            }
+
+            printf("%" PRIu64 " ", smp.instr_count);
+            if (hdr.flags & INSTHIST_FLAG_ASID)
+                printf("a%" PRIx64 " ", smp.asid);
+            if (hdr.num_windows > 1)
+                printf("w%" PRIu64 " ", window_sizes[smp.window]);
+            printf("{");
+            for (uint32_t i = 0; i < smp.nnz; i++) {
+                const char *name = ent[i].id < names.size() ? names[ent[i].id].c_str() : "?";
+                printf("\"%s\": %f, ", name, ent[i].count/(float)smp.window_insns);
+            }
+            printf("}\n");
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
@@ -0,0 +1,96 @@
+#ifndef __INSTHIST_FMT_H
+#define __INSTHIST_FMT_H
+
+// Binary sample stream written by insthist with format=binary, and read
+// back by insthist2txt. All fields are little-endian.
+//
+// The file starts with an insthist_header, followed by
+//   - num_windows uint64_t window sizes
+//   - num_ids names: a uint16_t length then that many bytes (no NUL),
+//     giving the mnemonic for each capstone instruction ID in order
+// and then a sequence of chunks. Each chunk is an insthist_chunk followed
+// by stored_size bytes, which (after inflating, if INSTHIST_FLAG_ZLIB is
+// set) hold raw_size bytes of back-to-back samples. A sample is an
+// insthist_sample followed by nnz insthist_entry records.
+
+#include <stdint.h>
+
+#define INSTHIST_MAGIC "IHST"
+#define INSTHIST_VERSION 2
+
+// Chunks are compressed with zlib
+#define INSTHIST_FLAG_ZLIB 1
+// Samples come from several address spaces (asids=); tag them in text
+#define INSTHIST_FLAG_ASID 2
+
+struct insthist_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t num_windows;
+    uint32_t num_ids;
+} __attribute__((packed));
+
+struct insthist_chunk {
+    uint32_t raw_size;
+    uint32_t stored_size;
+} __attribute__((packed));
+
+struct insthist_sample {
+    uint64_t instr_count;
+    // Address space the sample is for (0 unless INSTHIST_FLAG_ASID)
+    uint64_t asid;
+    // Number of instructions in the window; counts are divided by this
+    uint64_t window_insns;
+    // Index into the window size list
+    uint32_t window;
+    uint32_t nnz;
+} __attribute__((packed));
+
+// Version 1 samples, which had no ASID
+struct insthist_sample_v1 {
+    uint64_t instr_count;
+    uint64_t window_insns;
+    uint32_t window;
+    uint32_t nnz;
+} __attribute__((packed));
+
+struct insthist_entry {
+    uint16_t id;
+    uint32_t count;
+} __attribute__((packed));
+
+// Disassembly cache (cache=<file>). Starts with an insthist_cache_header,
+// followed by any number of entries: an insthist_cache_entry and then
+// npairs insthist_cache_pair records. New entries are appended at the end
+// of each run. The cache is only used if arch, capstone version and
+// num_ids all match, since instruction IDs change between capstone
+// releases.
+
+#define INSTHIST_CACHE_MAGIC "IHDC"
+#define INSTHIST_CACHE_VERSION 1
+
+struct insthist_cache_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t arch;
+    uint32_t cs_version;
+    uint32_t num_ids;
+} __attribute__((packed));
+
+struct insthist_cache_entry {
+    // Hash of the block's code bytes, mixed with the CPU mode
+    uint64_t code_hash;
+    uint16_t size;
+    uint8_t mode;
+    uint8_t pad;
+    uint32_t ninsns;
+    uint32_t npairs;
+} __attribute__((packed));
+
+struct insthist_cache_pair {
+    uint16_t id;
+    uint16_t count;
+} __attribute__((packed));
+
+#endif
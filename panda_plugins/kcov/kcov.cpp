@@ -21,6 +21,7 @@ extern "C" {
 #include "qemu-common.h"
 
 #include "panda_plugin.h"
+#include "rr_log.h"
 
 }
 
@@ -35,41 +36,89 @@ void uninit_plugin(void *);
 
 #include <zlib.h>
 
+#include "plugin_stats.h"
+#include "instr_range.h"
+
 const char *prefix;
 uint8_t kern[0x80000000 >> 3] = {};
 
+// plateau=<N>: stop once N guest instructions go by without any new
+// coverage bits, but not before plateau_min_instr
+uint64_t plateau = 0;
+uint64_t plateau_min_instr = 0;
+uint64_t covered_bits = 0;
+uint64_t last_new_instr = 0;
+bool written = false;
+
+static void write_coverage(void) {
+    char logfile[260] = {};
+    sprintf(logfile, "%s_kcov.dat.gz", prefix);
+    gzFile bblog = gzopen(logfile, "w");
+    if (!bblog) {
+        perror("gzopen");
+        return;
+    }
+    int nwritten = gzwrite(bblog, kern, sizeof(kern));
+    printf("kcov: wrote %d bytes to log file.\n", nwritten);
+    gzclose(bblog);
+    written = true;
+}
+
 static int before_block_exec(CPUState *env, TranslationBlock *tb) {
+    STATS_CALLBACK(before_block_exec);
+    if (!instr_range_active() || written) return 0;
+    if (plateau) {
+        uint64_t icount = rr_get_guest_instr_count();
+        if (icount - last_new_instr >= plateau && icount >= plateau_min_instr) {
+            printf("kcov: coverage saturated at instruction %" PRIu64 ": no new bits since %" PRIu64
+                   " (%" PRIu64 " bits set)\n", icount, last_new_instr, covered_bits);
+            write_coverage();
+            rr_end_replay_requested = 1;
+            return 0;
+        }
+    }
     // Only count kernel basic blocks
     if (tb->pc < 0x80000000 || tb->pc > 0xFFFFFFFF) return 0;
+    uint64_t new_bits = 0;
     for (target_ulong addr = tb->pc ; addr < tb->pc + tb->size; addr++) {
         unsigned int byte_offset = (addr - 0x80000000) / 8;
         unsigned int bit_offset =  (addr - 0x80000000) % 8;
+        new_bits += !(kern[byte_offset] & (1 << bit_offset));
         kern[byte_offset] |= (1 << bit_offset);
     }
+    if (new_bits) {
+        covered_bits += new_bits;
+        last_new_instr = rr_get_guest_instr_count();
+    }
     return 0;
 }
 
-bool init_plugin(void *self) {
+static void start_coverage(void *self) {
+    last_new_instr = rr_get_guest_instr_count();
     panda_cb pcb = { .before_block_exec = before_block_exec };
+    panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
+}
 
+bool init_plugin(void *self) {
     panda_arg_list *args = panda_get_args("kcov");
     prefix = panda_parse_string(args, "name", "kcov");
     printf("kcov: will log to %s_kcov.dat.gz\n", prefix);
+    STATS_INIT(self, "kcov", args);
+    STATS_BYTES_ADD("kcov bitmap", sizeof(kern));
+
+    plateau = panda_parse_uint64(args, "plateau", 0);
+    plateau_min_instr = panda_parse_uint64(args, "plateau_min_instr", 0);
+    if (plateau) {
+        printf("kcov: ending replay after %" PRIu64 " instructions without new coverage\n", plateau);
+    }
+
+    if (!instr_range_init(self, "kcov", args, start_coverage, NULL)) return false;
 
-    panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
- 
     return true;
 }
 
 void uninit_plugin(void *self) {
-    char logfile[260] = {};
-    sprintf(logfile, "%s_kcov.dat.gz", prefix);
-    gzFile bblog = gzopen(logfile, "w");
-    if (!bblog) {
-        perror("gzopen");
-        return;
-    }
-    int written = gzwrite(bblog, kern, sizeof(kern));
-    printf("kcov: wrote %d bytes to log file.\n", written);
-    gzclose(bblog);
+    STATS_DUMP();
+    // Already written if coverage saturated
+    if (!written) write_coverage();
 }
@@ -36,9 +36,22 @@ void uninit_plugin(void *);
 
 }
 
-#include <fstream>
 #include <vector>
 #include <algorithm>
+#include <deque>
+#include <set>
+#include <map>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "plugin_stats.h"
+#include "instr_range.h"
 
 #if TARGET_LONG_SIZE == 4 
 #define PRItlx "x"
@@ -48,35 +61,383 @@ void uninit_plugin(void *);
 #error TARGET_LONG_SIZE undefined
 #endif
 
+#define DUMP_PAGE_SIZE 0x1000
+
+#define KERN_BASE 0x80000000
+#define KERN_PAGE_BITS 12
+#define PC_BLOCK 16
+
 FILE *pluginlog;
+FILE *manifest;
 const char *outdir;
+
+// Watched PCs, sorted and deduplicated. Resolved PCs are marked dead
+// rather than erased, so lookups never have to shift the array.
 std::vector<target_ulong> pcs;
+std::vector<uint8_t> pc_dead;
+size_t pcs_live = 0;
+
+// One bit per kernel page that still has a live watched PC in it. Most
+// blocks are rejected here without touching the PC array at all.
+uint64_t page_bitmap[(0x80000000 >> KERN_PAGE_BITS) / 64] = {};
+
+// First PC of every PC_BLOCK-sized run of pcs, in Eytzinger (BFS) order so
+// the top levels of the search stay in cache. eyt_block maps each slot back
+// to its run number. Both are 1-indexed; slot 0 is unused.
+std::vector<target_ulong> eyt;
+std::vector<uint32_t> eyt_block;
+size_t nblocks = 0;
 
-static void dump_mod(CPUState *env, const char *name, target_ulong start, target_ulong size) {
-    FILE *f = fopen(name, "wb");
-    uint8_t buf[0x1000];
-    uint8_t zeros[0x1000] = {};
-    for (target_ulong addr = start; addr < start+size; addr += 0x1000) {
-        if (-1 == panda_virtual_memory_rw(env, addr, buf, 0x1000, false)) {
-            fwrite(zeros, 0x1000, 1, f);
+// Open-addressing set of TBs that contain at least one live watched PC,
+// decided once at translation time. Everything else returns straight away
+// in before_block_exec.
+#define TB_EMPTY ((TranslationBlock *)0)
+#define TB_DELETED ((TranslationBlock *)1)
+std::vector<TranslationBlock *> flagged(1024, TB_EMPTY);
+size_t flagged_count = 0;
+size_t flagged_used = 0;
+
+// Work items for the dump writer thread. A DUMP item carries a copy of a
+// module's pages; a LINK item records that the block at pc lives in a module
+// that was (or is about to be) dumped. Items are processed in order, so a
+// LINK always finds the file produced by the DUMP queued before it.
+struct dump_job {
+    enum { DUMP, LINK, STOP } kind;
+    std::string modname;
+    target_ulong base;
+    target_ulong size;
+    target_ulong pc;
+    std::vector<uint8_t> data;
+    // One flag per page; unreadable pages are left as holes in the file
+    std::vector<bool> present;
+};
+
+// Modules we have already read out of guest memory, by (name, base)
+std::set<std::pair<std::string,target_ulong>> dumped;
+
+std::deque<dump_job *> jobs;
+std::mutex jobs_lock;
+std::condition_variable jobs_cv;
+std::thread writer;
+
+static void queue_job(dump_job *job) {
+    {
+        std::lock_guard<std::mutex> lk(jobs_lock);
+        jobs.push_back(job);
+    }
+    jobs_cv.notify_one();
+}
+
+// FNV-1a; only used to name and deduplicate dump files
+static uint64_t hash_bytes(const uint8_t *buf, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= buf[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Dumps are written to a temp file and renamed into place, so a file with
+// a dump's name is always complete. Returns false (and leaves fname alone)
+// if the dump couldn't be written.
+static bool write_dump(dump_job *job, std::string &fname) {
+    char name[256];
+    uint64_t h = hash_bytes(job->data.data(), job->data.size());
+    snprintf(name, sizeof(name), "%016" PRIx64 ".%s", h, job->modname.c_str());
+
+    std::string path = std::string(outdir) + "/" + name;
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && (size_t)st.st_size == job->data.size()) {
+        // Same contents already on disk (e.g. module reloaded at a new base)
+        fname = name;
+        return true;
+    }
+
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open");
+        return false;
+    }
+    bool ok = true;
+    for (size_t i = 0; ok && i < job->present.size(); i++) {
+        if (!job->present[i]) continue;
+        if (pwrite(fd, &job->data[i*DUMP_PAGE_SIZE], DUMP_PAGE_SIZE, i*DUMP_PAGE_SIZE) != DUMP_PAGE_SIZE) {
+            perror("pwrite");
+            ok = false;
         }
-        else {
-            fwrite(buf, 0x1000, 1, f);
+    }
+    // Extend over any trailing unreadable pages so they become holes too
+    if (ok && ftruncate(fd, job->data.size()) != 0) {
+        perror("ftruncate");
+        ok = false;
+    }
+    if (close(fd) != 0) ok = false;
+    if (ok && rename(tmp.c_str(), path.c_str()) != 0) {
+        perror("rename");
+        ok = false;
+    }
+    if (!ok) {
+        unlink(tmp.c_str());
+        printf("kmodcheck: couldn't write dump of %s\n", job->modname.c_str());
+        return false;
+    }
+    fname = name;
+    return true;
+}
+
+static void write_link(dump_job *job, const std::string &fname) {
+    char name[256];
+    snprintf(name, sizeof(name), "%s/%08" PRItlx ".%s", outdir, job->pc, job->modname.c_str());
+    unlink(name);
+    if (symlink(fname.c_str(), name) != 0)
+        perror("symlink");
+    fprintf(manifest, "%08" PRItlx " %s %08" PRItlx " %08" PRItlx " %s\n", job->pc,
+            job->modname.c_str(), job->base, job->size, fname.c_str());
+}
+
+static void writer_thread() {
+    // (name, base) => file name of the dump, only touched by this thread
+    std::map<std::pair<std::string,target_ulong>,std::string> files;
+
+    while (true) {
+        dump_job *job;
+        {
+            std::unique_lock<std::mutex> lk(jobs_lock);
+            jobs_cv.wait(lk, []{ return !jobs.empty(); });
+            job = jobs.front();
+            jobs.pop_front();
+        }
+
+        if (job->kind == dump_job::STOP) {
+            delete job;
+            break;
         }
+
+        // Only holds a name once that dump is complete on disk, so links
+        // never point at a missing or partial file
+        std::string &fname = files[std::make_pair(job->modname, job->base)];
+        if (job->kind == dump_job::DUMP) {
+            write_dump(job, fname);
+        }
+        else if (!fname.empty()) {
+            write_link(job, fname);
+        }
+        delete job;
+    }
+}
+
+// Copy the module out of guest memory and hand it to the writer thread.
+// Each (name, base) is only read once; later blocks just get a link.
+static void dump_mod(CPUState *env, target_ulong pc, const char *name, target_ulong start, target_ulong size) {
+    auto key = std::make_pair(std::string(name), start);
+    if (dumped.find(key) == dumped.end()) {
+        dumped.insert(key);
+
+        dump_job *job = new dump_job;
+        job->kind = dump_job::DUMP;
+        job->modname = name;
+        job->base = start;
+        job->size = size;
+        size_t npages = (size + DUMP_PAGE_SIZE - 1) / DUMP_PAGE_SIZE;
+        job->data.resize(npages * DUMP_PAGE_SIZE);
+        job->present.resize(npages);
+        for (size_t i = 0; i < npages; i++) {
+            job->present[i] = (-1 != panda_virtual_memory_rw(env, start + i*DUMP_PAGE_SIZE,
+                        &job->data[i*DUMP_PAGE_SIZE], DUMP_PAGE_SIZE, false));
+            if (!job->present[i])
+                memset(&job->data[i*DUMP_PAGE_SIZE], 0, DUMP_PAGE_SIZE);
+        }
+        queue_job(job);
+    }
+
+    dump_job *link = new dump_job;
+    link->kind = dump_job::LINK;
+    link->modname = name;
+    link->base = start;
+    link->size = size;
+    link->pc = pc;
+    queue_job(link);
+}
+
+static inline bool page_test(target_ulong addr) {
+    target_ulong pg = (addr - KERN_BASE) >> KERN_PAGE_BITS;
+    return page_bitmap[pg / 64] & (1ULL << (pg % 64));
+}
+
+static inline void page_set(target_ulong addr) {
+    target_ulong pg = (addr - KERN_BASE) >> KERN_PAGE_BITS;
+    page_bitmap[pg / 64] |= (1ULL << (pg % 64));
+}
+
+static inline void page_clear(target_ulong addr) {
+    target_ulong pg = (addr - KERN_BASE) >> KERN_PAGE_BITS;
+    page_bitmap[pg / 64] &= ~(1ULL << (pg % 64));
+}
+
+static size_t build_eyt(size_t i, size_t k) {
+    if (k <= nblocks) {
+        i = build_eyt(i, 2*k);
+        eyt[k] = pcs[i * PC_BLOCK];
+        eyt_block[k] = i;
+        i++;
+        i = build_eyt(i, 2*k+1);
+    }
+    return i;
+}
+
+// Index of the first PC >= addr (pcs.size() if there is none)
+static size_t pc_lower_bound(target_ulong addr) {
+    // Find the first run whose first PC is > addr; addr can only be
+    // in the run before it.
+    size_t k = 1;
+    while (k <= nblocks)
+        k = 2*k + (eyt[k] <= addr);
+    k >>= __builtin_ffsll(~k);
+    size_t block = k ? eyt_block[k] : nblocks;
+    size_t i = block ? (block - 1) * PC_BLOCK : 0;
+    while (i < pcs.size() && pcs[i] < addr) i++;
+    return i;
+}
+
+// Collect the indices of live PCs in [lo, hi]
+static void find_pcs(target_ulong lo, target_ulong hi, std::vector<size_t> &out) {
+    out.clear();
+    for (size_t i = pc_lower_bound(lo); i < pcs.size() && pcs[i] <= hi; i++) {
+        if (!pc_dead[i]) out.push_back(i);
+    }
+}
+
+// Drop the page bit if nothing live is left on the page containing addr
+static void page_recheck(target_ulong addr) {
+    target_ulong lo = addr & ~((1 << KERN_PAGE_BITS) - 1);
+    for (size_t i = pc_lower_bound(lo); i < pcs.size() && pcs[i] <= lo + (1 << KERN_PAGE_BITS) - 1; i++) {
+        if (!pc_dead[i]) return;
     }
+    page_clear(addr);
+}
+
+// Parse whitespace-separated hex PCs (with or without 0x) from the whole
+// file in one pass; ifstream >> std::hex is far too slow for big lists.
+static bool load_pcs(const char *pcfile) {
+    FILE *f = fopen(pcfile, "rb");
+    if (!f) return false;
+    // Read until EOF rather than trusting the file size, so a pipe or
+    // /dev/stdin works too
+    std::vector<char> buf;
+    char chunk[1 << 16];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        buf.insert(buf.end(), chunk, chunk + n);
+    bool err = ferror(f);
     fclose(f);
+    if (err) return false;
+    size_t len = buf.size();
+    buf.push_back('\0');
+
+    const char *p = buf.data();
+    const char *end = p + len;
+    while (p < end) {
+        while (p < end && !isxdigit((unsigned char)*p)) p++;
+        if (p + 1 < end && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) p += 2;
+        if (p >= end || !isxdigit((unsigned char)*p)) continue;
+        uint64_t pc = 0;
+        for (; p < end && isxdigit((unsigned char)*p); p++) {
+            char c = *p;
+            pc = (pc << 4) | (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+        }
+        pcs.push_back(pc);
+    }
+    return true;
+}
+
+static inline size_t tb_slot(TranslationBlock *tb) {
+    return (((uintptr_t)tb) >> 4) * 0x9E3779B97F4A7C15ULL >> 20;
+}
+
+static bool tb_flagged(TranslationBlock *tb) {
+    size_t mask = flagged.size() - 1;
+    for (size_t i = tb_slot(tb) & mask; flagged[i] != TB_EMPTY; i = (i + 1) & mask) {
+        if (flagged[i] == tb) return true;
+    }
+    return false;
+}
+
+static void tb_unflag(TranslationBlock *tb) {
+    size_t mask = flagged.size() - 1;
+    for (size_t i = tb_slot(tb) & mask; flagged[i] != TB_EMPTY; i = (i + 1) & mask) {
+        if (flagged[i] == tb) {
+            flagged[i] = TB_DELETED;
+            flagged_count--;
+            return;
+        }
+    }
+}
+
+static void tb_flag(TranslationBlock *tb) {
+    if (tb_flagged(tb)) return;
+    if (2 * (flagged_used + 1) > flagged.size()) {
+        // Rehash, dropping tombstones; grow only if really needed
+        std::vector<TranslationBlock *> old(flagged.size() * (4 * flagged_count > flagged.size() ? 2 : 1), TB_EMPTY);
+        old.swap(flagged);
+        flagged_count = flagged_used = 0;
+        for (TranslationBlock *t : old) {
+            if (t != TB_EMPTY && t != TB_DELETED) tb_flag(t);
+        }
+    }
+    size_t mask = flagged.size() - 1;
+    size_t i = tb_slot(tb) & mask;
+    while (flagged[i] != TB_EMPTY && flagged[i] != TB_DELETED) i = (i + 1) & mask;
+    if (flagged[i] == TB_EMPTY) flagged_used++;
+    flagged[i] = tb;
+    flagged_count++;
+}
+
+// Fill hits with the live watched PCs inside tb
+static void block_pcs(TranslationBlock *tb, std::vector<size_t> &hits) {
+    hits.clear();
+    if (tb->pc < 0x80000000 || tb->pc > 0xFFFFFFFF) return;
+
+    target_ulong last = tb->pc + tb->size - 1;
+    if (!page_test(tb->pc) && (last > 0xFFFFFFFF || !page_test(last))) return;
+
+    find_pcs(tb->pc, last, hits);
+}
+
+#ifdef PLUGIN_STATS
+static size_t flagged_bytes(void) {
+    return flagged.capacity() * sizeof(TranslationBlock *);
+}
+#endif
+
+static int after_block_translate(CPUState *env, TranslationBlock *tb) {
+    STATS_CALLBACK(after_block_translate);
+    if (!instr_range_active()) return 0;
+    static std::vector<size_t> hits;
+    block_pcs(tb, hits);
+    // TBs get recycled, so a new translation must also clear any old flag
+    if (!hits.empty())
+        tb_flag(tb);
+    else if (flagged_count)
+        tb_unflag(tb);
+    return 0;
 }
 
 static int before_block_exec(CPUState *env, TranslationBlock *tb) {
-    if (tb->pc < 0x80000000 || tb->pc > 0xFFFFFFFF) return 0;
+    STATS_CALLBACK(before_block_exec);
+    if (!instr_range_active()) return 0;
+    // Nothing to see here, move along
+    if (!flagged_count || !tb_flagged(tb)) return 0;
 
-    auto begin = std::lower_bound(pcs.begin(), pcs.end(), tb->pc);
-    auto end = std::upper_bound(pcs.begin(), pcs.end(), tb->pc + tb->size - 1);
-    
-    if (begin == end) {
-        // Nothing to see here, move along
+    static std::vector<size_t> hits;
+    block_pcs(tb, hits);
+    if (hits.empty()) {
+        // Resolved while running some other block that overlaps this one
+        tb_unflag(tb);
         return 0;
     }
+    target_ulong last = tb->pc + tb->size - 1;
 
     OsiModules *kms = get_modules(env);
     if (kms == NULL) {
@@ -96,31 +457,45 @@ static int before_block_exec(CPUState *env, TranslationBlock *tb) {
         }
 
         if (!found) {
-            for (auto p = begin; p != end; ++p) {
-                fprintf(pluginlog, TARGET_FMT_lx " no_mod\n", *p);
+            for (size_t h : hits) {
+                fprintf(pluginlog, TARGET_FMT_lx " no_mod\n", pcs[h]);
             }
         }
         else {
-            for (auto p = begin; p != end; ++p) {
-                fprintf(pluginlog, TARGET_FMT_lx " %s %s\n", *p, kms->module[i].name, kms->module[i].file);
+            for (size_t h : hits) {
+                fprintf(pluginlog, TARGET_FMT_lx " %s %s\n", pcs[h], kms->module[i].name, kms->module[i].file);
             }
-            char mod[128];
-            sprintf(mod, "%s/%08" PRItlx ".%s", outdir, tb->pc, kms->module[i].name);
-            dump_mod(env, mod, kms->module[i].base, kms->module[i].size);
+            dump_mod(env, tb->pc, kms->module[i].name, kms->module[i].base, kms->module[i].size);
         }
 
         // No need to search for these any more. Either we found
         // the correct module and dumped it or it was unknown.
-        pcs.erase(begin, end);
+        for (size_t h : hits) pc_dead[h] = 1;
+        pcs_live -= hits.size();
+        page_recheck(tb->pc);
+        if (last <= 0xFFFFFFFF) page_recheck(last);
+        tb_unflag(tb);
 
         // We can terminate early if we're done searching
-        if (pcs.empty())
+        if (pcs_live == 0)
             rr_end_replay_requested = 1;
     }
     free_osimodules(kms);
     return 0;
 }
 
+// TBs are only flagged as they're translated, so anything translated
+// before the start of the range has to be flushed.
+static void start_watching(void *self) {
+    panda_cb pcb;
+
+    panda_do_flush_tb();
+    pcb.after_block_translate = after_block_translate;
+    panda_register_callback(self, PANDA_CB_AFTER_BLOCK_TRANSLATE, pcb);
+    pcb.before_block_exec = before_block_exec;
+    panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
+}
+
 bool init_plugin(void *self) {
     panda_require("osi");
     if(!init_osi_api()) return false;
@@ -129,6 +504,7 @@ bool init_plugin(void *self) {
     outdir = panda_parse_string(args, "outdir", ".");
     const char *logname = panda_parse_string(args, "log", "kmodcheck.log");
     const char *pcfile = panda_parse_string(args, "pcfile", "kmodcheck.pcs");
+    STATS_INIT(self, "kmodcheck", args);
 
     pluginlog = fopen(logname, "w");
     if (!pluginlog) {
@@ -136,25 +512,50 @@ bool init_plugin(void *self) {
         return false;
     }
     
-    std::ifstream pcf(pcfile);
-    if (!pcf) {
-        printf("Couldn't open %s; no PCs to search for. Exiting.\n", pcfile);
+    char manifest_name[260];
+    snprintf(manifest_name, sizeof(manifest_name), "%s/kmodcheck.manifest", outdir);
+    manifest = fopen(manifest_name, "w");
+    if (!manifest) {
+        printf("Couldn't open %s for writing. Exiting.\n", manifest_name);
         return false;
     }
 
-    target_ulong pc;
-    while (pcf >> std::hex >> pc) {
-        pcs.push_back(pc);
+    if (!load_pcs(pcfile)) {
+        printf("Couldn't open %s; no PCs to search for. Exiting.\n", pcfile);
+        return false;
     }
-    pcf.close();
     std::sort(pcs.begin(), pcs.end());
+    pcs.erase(std::unique(pcs.begin(), pcs.end()), pcs.end());
+    pc_dead.assign(pcs.size(), 0);
+    pcs_live = pcs.size();
+    for (target_ulong pc : pcs) {
+        if (pc >= KERN_BASE && pc <= 0xFFFFFFFF) page_set(pc);
+    }
 
-    panda_cb pcb = { .before_block_exec = before_block_exec };
-    panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
+    nblocks = (pcs.size() + PC_BLOCK - 1) / PC_BLOCK;
+    eyt.resize(nblocks + 1);
+    eyt_block.resize(nblocks + 1);
+    build_eyt(0, 1);
+    printf("kmodcheck: watching %zu PCs.\n", pcs.size());
+    STATS_BYTES_ADD("pc index", pcs.capacity() * sizeof(target_ulong) + pc_dead.capacity() +
+                    eyt.capacity() * sizeof(target_ulong) + eyt_block.capacity() * sizeof(uint32_t) +
+                    sizeof(page_bitmap));
+    STATS_BYTES_FN("tb flags", flagged_bytes);
+
+    if (!instr_range_init(self, "kmodcheck", args, start_watching, NULL)) return false;
+
+    writer = std::thread(writer_thread);
 
     return true;
 }
 
 void uninit_plugin(void *self) {
+    STATS_DUMP();
+    dump_job *stop = new dump_job;
+    stop->kind = dump_job::STOP;
+    queue_job(stop);
+    writer.join();
+
+    fclose(manifest);
     fclose(pluginlog);
 }
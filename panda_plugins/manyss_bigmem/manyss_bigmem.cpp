@@ -23,6 +23,9 @@ extern "C" {
 #include "cpu.h"
 
 #include "panda_plugin.h"
+#include "rr_log.h"
+#include "osi/osi_types.h"
+#include "osi/osi_ext.h"
 }
 
 #include <stdio.h>
@@ -34,14 +37,17 @@ extern "C" {
 #include <unordered_map>
 using namespace std;
 
+#include "plugin_stats.h"
+#include "instr_range.h"
+#include "hll.h"
+#include "ss_search.h"
+
 // These need to be extern "C" so that the ABI is compatible with
 // QEMU/PANDA, which is written in C
 extern "C" {
 
 bool init_plugin(void *);
 void uninit_plugin(void *);
-int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
-int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
 
 }
 
@@ -49,16 +55,15 @@ struct ss_node {
     // NULL not allowed
     ss_node *children[255];
     uint32_t count;
+    // Distinct address/PC sketches, with distinct_mb
+    hll_sketch *distinct;
 };
 
-#define MINWORD 4
-#define WINDOW_SIZE 20
-unsigned int ridx = 0;
-uint8_t read_window[WINDOW_SIZE];
-unsigned int widx = 0;
-uint8_t write_window[WINDOW_SIZE];
 ss_node t = {};
 
+// distinct_mb=: estimated distinct addresses and PCs per string (hll.h)
+hll_distinct distinct;
+
 void ss_insert (ss_node *t, const char *s) {
     int slen = strlen(s);
     ss_node *cur_node = t;
@@ -66,6 +71,7 @@ void ss_insert (ss_node *t, const char *s) {
         int idx = ((unsigned char)s[i]) - 1;
         if (!cur_node->children[idx]) {
             cur_node->children[idx] = (ss_node *) calloc(1, sizeof(ss_node));
+            STATS_BYTES_ADD("trie", sizeof(ss_node));
         }
         cur_node = cur_node->children[idx];
     }
@@ -108,37 +114,11 @@ void ss_traverse(ss_node *root,
     ss_traverse_internal(root, handle, arg, word, 0);
 }
 
-int mem_callback(CPUState *env, target_ulong pc, target_ulong addr,
-                       target_ulong size, void *buf, bool is_write,
-                       uint8_t (&window)[WINDOW_SIZE]) {
-    unsigned int idx;
-    if (is_write) idx = widx;
-    else idx = ridx;
-    for (unsigned int i = 0; i < size; i++) {
-        uint8_t val = ((uint8_t *)buf)[i];
-        // Hack: skip NULLs to get free UTF-16 support
-        // Also skip punctuation
-        switch (val) {
-            case 0: case '!': case '"': case '#': case '$':
-            case '%': case '&': case '\'': case '(': case ')':
-            case '*': case '+': case ',': case '-': case '.':
-            case '/': case ':': case ';': case '<': case '=':
-            case '>': case '?': case '@': case '[': case '\\':
-            case ']': case '^': case '_': case '`': case '{':
-            case '|': case '}': case '~':
-                continue;
-        }
-
-        if ('a' <= val && val <= 'z') val &= ~0x20;
-        window[idx++] = val;
-        if (idx >= WINDOW_SIZE) idx -= WINDOW_SIZE;
-    }
-
-    unsigned int midx = idx;
-    char search[WINDOW_SIZE+1] = {};
+// Walk the trie along the window, counting every string of MINWORD or more
+// bytes that ends it
+static void match_strings(CPUState *env, target_ulong pc, target_ulong addr,
+                          const char *search) {
     char search_tmp[WINDOW_SIZE+1] = {};
-    memcpy(search, window+midx, WINDOW_SIZE-midx);
-    memcpy(search+(WINDOW_SIZE-midx), window, midx);
     memcpy(search_tmp, search, WINDOW_SIZE);
 
     // Initial setup: find the subtree (if any) that contains
@@ -148,7 +128,10 @@ int mem_callback(CPUState *env, target_ulong pc, target_ulong addr,
     int i = MINWORD;
     search_tmp[i] = '\0';
     int r = ss_find(&nearest, search_tmp);
-    if (r) nearest->count++;
+    if (r) {
+        nearest->count++;
+        hll_distinct_add(&distinct, nearest->distinct, addr, pc);
+    }
     search_tmp[i] = search[i]; i++;
 
     // Now the loop. Feed one character at a time.
@@ -157,32 +140,20 @@ int mem_callback(CPUState *env, target_ulong pc, target_ulong addr,
         if (!nearest) break;
         next[0] = search[i-1];
         r = ss_find(&nearest, next);
-        if (r) nearest->count++;
+        if (r) {
+            nearest->count++;
+            hll_distinct_add(&distinct, nearest->distinct, addr, pc);
+        }
     }
-    if (is_write) widx = idx;
-    else ridx = idx;
-    return 1;
-}
-
-int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr,
-                       target_ulong size, void *buf) {
-    return mem_callback(env, pc, addr, size, buf, false, read_window);
-
-}
-
-int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr,
-                       target_ulong size, void *buf) {
-    return mem_callback(env, pc, addr, size, buf, true, write_window);
 }
 
 FILE *mem_report = NULL;
 
 bool init_plugin(void *self) {
-    panda_cb pcb;
-
     printf("Initializing plugin manyss_bigmem\n");
 
     panda_arg_list *args = panda_get_args("manyss_bigmem");
+    STATS_INIT(self, "manyss_bigmem", args);
 
     const char *prefix = panda_parse_string(args, "name", "manyss_bigmem");
     char stringsfile[128] = {};
@@ -232,25 +203,37 @@ bool init_plugin(void *self) {
         return false;
     }
 
-    // Enable memory logging
-    panda_enable_memcb();
-
-    pcb.virt_mem_write = mem_write_callback;
-    panda_register_callback(self, PANDA_CB_VIRT_MEM_WRITE, pcb);
-    pcb.virt_mem_read = mem_read_callback;
-    panda_register_callback(self, PANDA_CB_VIRT_MEM_READ, pcb);
+    uint64_t distinct_mb = panda_parse_uint64(args, "distinct_mb", 0);
+    if (!hll_distinct_init(&distinct, distinct_mb)) {
+        printf("Couldn't allocate %" PRIu64 " MB for distinct counts. Exiting.\n", distinct_mb);
+        return false;
+    }
+    if (distinct.on) {
+        printf("Estimating distinct addresses and PCs, for up to %zu strings\n",
+               hll_distinct_capacity(&distinct));
+        STATS_BYTES_FN("distinct", []() { return hll_distinct_bytes(&distinct); });
+    }
 
+    if (!ss_search_init(self, "manyss_bigmem", args, match_strings))
+        return false;
 
     return true;
 }
 
 bool printfn(const char *s, ss_node *n, void *arg) {
-    if (n->count - 1)
-        fprintf(mem_report, "%s %u\n", s, n->count - 1);
+    if (!(n->count - 1)) return true;
+    // With distinct_mb, lines are "<string> <count> <addrs> <pcs>"
+    char est[64];
+    if (!hll_distinct_format(&distinct, n->distinct, est, sizeof(est))) (*(size_t *)arg)++;
+    fprintf(mem_report, "%s %u%s\n", s, n->count - 1, est);
     return true;
 }
 
 void uninit_plugin(void *self) {
-    ss_traverse(&t, printfn, NULL);
+    STATS_DUMP();
+    size_t no_sketch = 0;
+    ss_traverse(&t, printfn, &no_sketch);
+    if (no_sketch)
+        printf("WARNING: distinct_mb was too small; %zu matched strings have no distinct counts.\n", no_sketch);
     fclose(mem_report);
 }
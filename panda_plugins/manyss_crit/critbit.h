@@ -16,20 +16,42 @@ typedef struct {
 
 typedef struct { void *root; } critbit0_tree;
 
-inline int critbit0_contains(critbit0_tree *t, const char *u, critbit0_node **nearest) {
+// Every leaf string is preceded by a header holding a bitmask of the lists
+// (tags) it was inserted from, so a string that is in several lists is
+// only stored once.
+typedef struct { uint64_t tags; } critbit0_leaf;
+
+#define critbit0_tags(p) ((((critbit0_leaf *)(p)) - 1)->tags)
+
+static inline char *critbit0_new_leaf(const uint8 *u, size_t ulen, uint64_t tags) {
+  char *x;
+  if (posix_memalign((void **)&x, sizeof(void *), sizeof(critbit0_leaf) + ulen + 1))
+    return NULL;
+  ((critbit0_leaf *)x)->tags = tags;
+  x += sizeof(critbit0_leaf);
+  memcpy(x, u, ulen + 1);
+  return x;
+}
+
+static inline void critbit0_free_leaf(void *p) {
+  free(((critbit0_leaf *)p) - 1);
+}
+
+// Returns the stored copy of u (whose tags can be read with critbit0_tags),
+// or NULL if it isn't in the tree.
+inline const char *critbit0_find(critbit0_tree *t, const char *u, critbit0_node **nearest) {
   const uint8 *ubytes = (uint8 *)u;
   const size_t ulen = strlen(u);
   uint8 *p = (uint8 *)t->root;
 
   if (!p)
-    return 0;
+    return NULL;
 
   // If we have been given a hint about where to start, go directly there.
-  if (nearest && *nearest) {
+  // A tree holding a single string has no internal nodes, so the hint may
+  // be the root leaf; ignore it then.
+  if (nearest && *nearest && (1 & (intptr_t)*nearest))
     p = (uint8 *)*nearest;
-    // Nearest node must not be a leaf node
-    assert((1 & (intptr_t)p));
-  }
 
   critbit0_node *q = NULL;
   while (1 & (intptr_t)p) {
@@ -45,23 +67,26 @@ inline int critbit0_contains(critbit0_tree *t, const char *u, critbit0_node **ne
 
   // q points to the closest non-leaf node. Mark it as an internal node
   // and return it.
-  if (nearest)
+  if (nearest && q)
     *nearest = (critbit0_node *)(((uint8 *)q) + 1);
 
-  return 0 == strcmp(u, (const char *)p);
+  return 0 == strcmp(u, (const char *)p) ? (const char *)p : NULL;
 }
 
-int critbit0_insert(critbit0_tree *t, const char *u) {
+inline int critbit0_contains(critbit0_tree *t, const char *u, critbit0_node **nearest) {
+  return critbit0_find(t, u, nearest) != NULL;
+}
+
+// Inserting a string that is already present adds tags to its tag mask
+int critbit0_insert(critbit0_tree *t, const char *u, uint64_t tags) {
   const uint8 *const ubytes = (uint8 *)u;
   const size_t ulen = strlen(u);
   uint8 *p = (uint8 *)t->root;
 
   if (!p) {
-    char *x;
-    int a = posix_memalign((void **)&x, sizeof(void *), ulen + 1);
-    if (a)
+    char *x = critbit0_new_leaf(ubytes, ulen, tags);
+    if (!x)
       return 0;
-    memcpy(x, u, ulen + 1);
     t->root = x;
     return 2;
   }
@@ -91,6 +116,7 @@ int critbit0_insert(critbit0_tree *t, const char *u) {
     newotherbits = p[newbyte];
     goto different_byte_found;
   }
+  critbit0_tags(p) |= tags;
   return 1;
 
 different_byte_found:
@@ -106,12 +132,11 @@ different_byte_found:
   if (posix_memalign((void **)&newnode, sizeof(void *), sizeof(critbit0_node)))
     return 0;
 
-  char *x;
-  if (posix_memalign((void **)&x, sizeof(void *), ulen + 1)) {
+  char *x = critbit0_new_leaf(ubytes, ulen, tags);
+  if (!x) {
     free(newnode);
     return 0;
   }
-  memcpy(x, ubytes, ulen + 1);
 
   newnode->byte = newbyte;
   newnode->otherbits = newotherbits;
@@ -165,7 +190,7 @@ int critbit0_delete(critbit0_tree *t, const char *u) {
 
   if (0 != strcmp(u, (const char *)p))
     return 0;
-  free(p);
+  critbit0_free_leaf(p);
 
   if (!whereq) {
     t->root = 0;
@@ -187,7 +212,7 @@ static void traverse(void *top) {
     traverse(q->child[1]);
     free(q);
   } else {
-    free(p);
+    critbit0_free_leaf(p);
   }
 }
 
@@ -23,6 +23,9 @@ extern "C" {
 #include "cpu.h"
 
 #include "panda_plugin.h"
+#include "rr_log.h"
+#include "osi/osi_types.h"
+#include "osi/osi_ext.h"
 }
 
 #include <stdio.h>
@@ -33,6 +36,7 @@ extern "C" {
 #include <iostream>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 using namespace std;
 
 // These need to be extern "C" so that the ABI is compatible with
@@ -41,62 +45,47 @@ extern "C" {
 
 bool init_plugin(void *);
 void uninit_plugin(void *);
-int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
-int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr, target_ulong size, void *buf);
 
 }
 
 #include "critbit.h"
-
-unordered_map<string,int> matches;
+#include "plugin_stats.h"
+#include "instr_range.h"
+#include "hll.h"
+#include "ss_search.h"
+
+// Matches, keyed by the string's copy in the critbit tree
+struct ss_match {
+    uint32_t count;
+    hll_sketch *distinct;
+};
+unordered_map<const char *,ss_match> matches;
+
+// Each input list has a tag, and each tag gets its own report. A string's
+// tag mask in the tree says which tags it came from. Lists given the same
+// tag are merged.
+#define MAX_TAGS 64
+struct tag_list {
+    string name;
+    FILE *report;
+};
+vector<tag_list> tag_lists;
 // This should properly be a char[4] but I can't be bothered
 // to figure out how to get the template+hash magic to work.
 unordered_set<uint32_t> prefixes;
 
-#define MINWORD 4
-#define WINDOW_SIZE 20
-unsigned int ridx = 0;
-uint8_t read_window[WINDOW_SIZE];
-unsigned int widx = 0;
-uint8_t write_window[WINDOW_SIZE];
-
 critbit0_tree t;
 
-int mem_callback(CPUState *env, target_ulong pc, target_ulong addr,
-                       target_ulong size, void *buf, bool is_write,
-                       uint8_t (&window)[WINDOW_SIZE]) {
-    unsigned int idx;
-    if (is_write) idx = widx;
-    else idx = ridx;
-    for (unsigned int i = 0; i < size; i++) {
-        uint8_t val = ((uint8_t *)buf)[i];
-        // Hack: skip NULLs to get free UTF-16 support
-        // Also skip punctuation
-        switch (val) {
-            case 0: case '!': case '"': case '#': case '$':
-            case '%': case '&': case '\'': case '(': case ')':
-            case '*': case '+': case ',': case '-': case '.':
-            case '/': case ':': case ';': case '<': case '=':
-            case '>': case '?': case '@': case '[': case '\\':
-            case ']': case '^': case '_': case '`': case '{':
-            case '|': case '}': case '~':
-                continue;
-        }
+// distinct_mb=: estimated distinct addresses and PCs per string (hll.h)
+hll_distinct distinct;
 
-        if ('a' <= val && val <= 'z') val &= ~0x20;
-        window[idx++] = val;
-        if (idx >= WINDOW_SIZE) idx -= WINDOW_SIZE;
-    }
-
-    unsigned int midx = idx;
-    char search[WINDOW_SIZE+1] = {};
+// Look for every string of MINWORD or more bytes that ends the window
+static void match_strings(CPUState *env, target_ulong pc, target_ulong addr,
+                          const char *search) {
     char search_tmp[WINDOW_SIZE+1] = {};
-    memcpy(search, window+midx, WINDOW_SIZE-midx);
-    memcpy(search+(WINDOW_SIZE-midx), window, midx);
-    
     if (prefixes.find(*(uint32_t *)search) == prefixes.end())
-        goto done;
-    
+        return;
+
     memcpy(search_tmp, search, WINDOW_SIZE);
 
     critbit0_node *nearest;
@@ -104,100 +93,172 @@ int mem_callback(CPUState *env, target_ulong pc, target_ulong addr,
     for (int i = MINWORD; i < WINDOW_SIZE; i++) {
         search_tmp[i] = '\0';
         critbit0_node *new_nearest = nearest;
-        if(critbit0_contains(&t, search_tmp, &new_nearest)) {
-            matches[search_tmp]++;
+        const char *found = critbit0_find(&t, search_tmp, &new_nearest);
+        if(found) {
+            ss_match &m = matches[found];
+            m.count++;
+            hll_distinct_add(&distinct, m.distinct, addr, pc);
             // Match succeeded, so we can save time on future suffixes
             nearest = new_nearest;
         }
         search_tmp[i] = search[i];
     }
-
-done:
-    if (is_write) widx = idx;
-    else ridx = idx;
-    return 1;
 }
 
-int mem_read_callback(CPUState *env, target_ulong pc, target_ulong addr,
-                       target_ulong size, void *buf) {
-    return mem_callback(env, pc, addr, size, buf, false, read_window);
-
+// Split a colon-separated argument
+static vector<string> split_list(const char *spec) {
+    vector<string> items;
+    string cur;
+    for (const char *p = spec; *p; p++) {
+        if (*p == ':') {
+            items.push_back(cur);
+            cur.clear();
+        }
+        else {
+            cur += *p;
+        }
+    }
+    items.push_back(cur);
+    return items;
 }
 
-int mem_write_callback(CPUState *env, target_ulong pc, target_ulong addr,
-                       target_ulong size, void *buf) {
-    return mem_callback(env, pc, addr, size, buf, true, write_window);
+// Default tag for a list: its file name without directory or extension
+static string tag_from_path(const string &path) {
+    size_t slash = path.rfind('/');
+    string base = slash == string::npos ? path : path.substr(slash + 1);
+    size_t dot = base.rfind('.');
+    return (dot == string::npos || dot == 0) ? base : base.substr(0, dot);
 }
 
-FILE *mem_report = NULL;
-
 bool init_plugin(void *self) {
-    panda_cb pcb;
-
     printf("Initializing plugin manyss_crit\n");
 
     panda_arg_list *args = panda_get_args("manyss_crit");
+    STATS_INIT(self, "manyss_crit", args);
 
     const char *outfile = panda_parse_string(args, "output", "manyss_crit");
-    const char *infile = panda_parse_string(args, "input", "manyss_crit");
-
-    printf ("search strings file [%s]\n", infile);
-
-    std::ifstream search_strings(infile);
-    if (!search_strings) {
-        printf("Couldn't open %s; no strings to search for. Exiting.\n", infile);
+    const char *infiles = panda_parse_string(args, "input", "manyss_crit");
+    const char *tag_names = panda_parse_string(args, "tags", NULL);
+
+    // input=a.txt:b.txt:... searches for several lists at once
+    vector<string> inputs = split_list(infiles);
+    vector<string> names;
+    if (tag_names) names = split_list(tag_names);
+    if (tag_names && names.size() != inputs.size()) {
+        printf("Got %zu tags for %zu input lists. Exiting.\n", names.size(), inputs.size());
+        return false;
+    }
+    // Tag bit for each input
+    vector<size_t> input_tags;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        string name = tag_names ? names[i] : tag_from_path(inputs[i]);
+        size_t tag;
+        for (tag = 0; tag < tag_lists.size(); tag++) {
+            if (tag_lists[tag].name == name) break;
+        }
+        if (tag == tag_lists.size()) {
+            tag_list tl;
+            tl.name = name;
+            tl.report = NULL;
+            tag_lists.push_back(tl);
+        }
+        input_tags.push_back(tag);
+    }
+    if (tag_lists.size() > MAX_TAGS) {
+        printf("At most %d different tags are supported. Exiting.\n", MAX_TAGS);
         return false;
     }
 
-    // Format: strings, one per line, uppercase
-    std::string line;
-    size_t nstrings = 0;
+    size_t nstrings = 0, nunique = 0;
     bool too_short = false;
     bool too_long = false;
-    while(std::getline(search_strings, line)) {
-        if (line.length() > WINDOW_SIZE) {
-            too_long = true;
-            continue;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        const char *infile = inputs[i].c_str();
+        size_t tag = input_tags[i];
+        printf ("search strings file [%s] tag [%s]\n", infile, tag_lists[tag].name.c_str());
+
+        std::ifstream search_strings(infile);
+        if (!search_strings) {
+            printf("Couldn't open %s; no strings to search for. Exiting.\n", infile);
+            return false;
         }
-        if (line.length() < MINWORD) {
-            too_short = true;
-            continue;
-        }
-        prefixes.insert(*(uint32_t *)line.substr(0,4).c_str());
-        critbit0_insert(&t, line.c_str());
-        if (nstrings % 100000 == 1) {
-            printf("*");
-            fflush(stdout);
+
+        // Format: strings, one per line, uppercase
+        std::string line;
+        while(std::getline(search_strings, line)) {
+            if (line.length() > WINDOW_SIZE) {
+                too_long = true;
+                continue;
+            }
+            if (line.length() < MINWORD) {
+                too_short = true;
+                continue;
+            }
+            prefixes.insert(*(uint32_t *)line.substr(0,4).c_str());
+            // Each new string costs a copy of itself plus, after the first,
+            // an internal node
+            if (critbit0_insert(&t, line.c_str(), 1ULL << tag) == 2) {
+                STATS_BYTES_ADD("critbit", sizeof(critbit0_leaf) + line.length() + 1 +
+                                (nunique ? sizeof(critbit0_node) : 0));
+                nunique++;
+            }
+            if (nstrings % 100000 == 1) {
+                printf("*");
+                fflush(stdout);
+            }
+            nstrings++;
         }
-        nstrings++;
     }
-    printf("\nAdded %zu strings to the hash table.\n", nstrings);
+    printf("\nAdded %zu strings (%zu distinct) to the hash table.\n", nstrings, nunique);
     if (too_long)
         printf("WARNING: Some lines in the input were too long (more than %d characters) and were skipped.\n", WINDOW_SIZE);
     if (too_short)
         printf("WARNING: Some lines in the input were too short (less than %d characters) and were skipped.\n", MINWORD);
 
-    mem_report = fopen(outfile, "w");
-    if(!mem_report) {
-        printf("Couldn't write report:\n");
-        perror("fopen");
-        return false;
+    // One list keeps the old behaviour of writing straight to output
+    for (auto &tl : tag_lists) {
+        string fname = inputs.size() == 1 ? string(outfile) : string(outfile) + "." + tl.name;
+        tl.report = fopen(fname.c_str(), "w");
+        if(!tl.report) {
+            printf("Couldn't write report %s:\n", fname.c_str());
+            perror("fopen");
+            return false;
+        }
     }
 
-    // Enable memory logging
-    panda_enable_memcb();
+    uint64_t distinct_mb = panda_parse_uint64(args, "distinct_mb", 0);
+    if (!hll_distinct_init(&distinct, distinct_mb)) {
+        printf("Couldn't allocate %" PRIu64 " MB for distinct counts. Exiting.\n", distinct_mb);
+        return false;
+    }
+    if (distinct.on) {
+        printf("Estimating distinct addresses and PCs, for up to %zu strings\n",
+               hll_distinct_capacity(&distinct));
+        STATS_BYTES_FN("distinct", []() { return hll_distinct_bytes(&distinct); });
+    }
 
-    pcb.virt_mem_write = mem_write_callback;
-    panda_register_callback(self, PANDA_CB_VIRT_MEM_WRITE, pcb);
-    pcb.virt_mem_read = mem_read_callback;
-    panda_register_callback(self, PANDA_CB_VIRT_MEM_READ, pcb);
+    if (!ss_search_init(self, "manyss_crit", args, match_strings))
+        return false;
 
     return true;
 }
 
 void uninit_plugin(void *self) {
-    for (auto &kvp : matches)
-        if (kvp.second)
-            fprintf(mem_report, "%s %u\n", kvp.first.c_str(), kvp.second);
-    fclose(mem_report);
+    STATS_DUMP();
+    size_t no_sketch = 0;
+    for (auto &kvp : matches) {
+        ss_match &m = kvp.second;
+        if (!m.count) continue;
+        // With distinct_mb, lines are "<string> <count> <addrs> <pcs>"
+        char est[64];
+        if (!hll_distinct_format(&distinct, m.distinct, est, sizeof(est))) no_sketch++;
+        uint64_t tags = critbit0_tags(kvp.first);
+        for (size_t i = 0; i < tag_lists.size(); i++) {
+            if (tags & (1ULL << i))
+                fprintf(tag_lists[i].report, "%s %u%s\n", kvp.first, m.count, est);
+        }
+    }
+    if (no_sketch)
+        printf("WARNING: distinct_mb was too small; %zu matched strings have no distinct counts.\n", no_sketch);
+    for (auto &tl : tag_lists) fclose(tl.report);
 }
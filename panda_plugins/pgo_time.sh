@@ -0,0 +1,20 @@
+#!/bin/sh
+# Usage: pgo_time.sh <runs> <command>
+# Runs the command (with sh -c) the given number of times, discarding its
+# output, and prints the fastest wall-clock time in seconds.
+
+runs=$1
+cmd=$2
+best=
+i=0
+while [ $i -lt $runs ]; do
+    start=$(date +%s.%N)
+    sh -c "$cmd" > /dev/null 2>&1 || { echo "workload failed: $cmd" >&2; exit 1; }
+    end=$(date +%s.%N)
+    t=$(echo "$start $end" | awk '{ printf "%.3f", $2 - $1 }')
+    if [ -z "$best" ] || [ $(echo "$t $best" | awk '{ print ($1 < $2) }') = 1 ]; then
+        best=$t
+    fi
+    i=$((i + 1))
+done
+echo $best